@@ -0,0 +1,124 @@
+/*
+ * exec-bench: measure exec-to-exit time and page faults of a program.
+ *
+ * Runs the program n times, each time with stdin redirected from a file,
+ * and reports wall clock time (from fork to reap) and minor/major page
+ * faults and peak RSS of the child as reported by wait4(). A prepare
+ * command, if given, is run through the shell before each run and is not
+ * timed.
+ *
+ * usage: exec-bench [-n runs] [-i stdin-file] [-p prepare-cmd] -- program [args...]
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *input = "/dev/null";
+	const char *prepare = NULL;
+	unsigned long minflt = 0, majflt = 0;
+	long maxrss = 0;
+	double *times;
+	int opt, i, n = 1000, failed = 0;
+
+	while ((opt = getopt(argc, argv, "n:i:p:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'i':
+			input = optarg;
+			break;
+		case 'p':
+			prepare = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n runs] [-i stdin-file] [-p prepare-cmd] -- program [args...]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (optind >= argc || n <= 0) {
+		fprintf(stderr, "usage: %s [-n runs] [-i stdin-file] [-p prepare-cmd] -- program [args...]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	times = calloc(n, sizeof(double));
+	if (!times) {
+		perror("calloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < n; i++) {
+		struct rusage ru;
+		double start;
+		pid_t pid;
+		int status;
+
+		if (prepare && system(prepare) != 0) {
+			fprintf(stderr, "prepare command failed: %s\n", prepare);
+			return EXIT_FAILURE;
+		}
+
+		start = now_us();
+		pid = fork();
+		if (pid < 0) {
+			perror("fork");
+			return EXIT_FAILURE;
+		}
+
+		if (pid == 0) {
+			int fd = open(input, O_RDONLY);
+
+			if (fd < 0 || dup2(fd, STDIN_FILENO) < 0)
+				_exit(127);
+			execv(argv[optind], &argv[optind]);
+			_exit(127);
+		}
+
+		if (wait4(pid, &status, 0, &ru) < 0) {
+			perror("wait4");
+			return EXIT_FAILURE;
+		}
+		times[i] = now_us() - start;
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed++;
+		minflt += ru.ru_minflt;
+		majflt += ru.ru_majflt;
+		if (ru.ru_maxrss > maxrss)
+			maxrss = ru.ru_maxrss;
+	}
+
+	qsort(times, n, sizeof(double), cmp_double);
+	printf("%s: runs=%d failed=%d median=%.0fus p90=%.0fus p99=%.0fus minflt=%.1f majflt=%.1f maxrss=%ldkB\n",
+	       argv[optind], n, failed, times[n / 2], times[n * 9 / 10], times[n * 99 / 100],
+	       (double)minflt / n, (double)majflt / n, maxrss);
+	free(times);
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+ * pathcmp-bench: microbenchmark of mount path comparisons.
+ *
+ * Builds a table of overlay2 style mount points (long paths sharing a
+ * /var/lib/docker/overlay2/ or /var/lib/docker/containers/ prefix and
+ * differing only in a 64 character id) and looks paths up in it, the way
+ * oci-umount does for mountinfo and config.json mounts. Compares plain
+ * strcmp() scans with length and hash first scans using pathcmp.h, and
+ * path_bytes_equal() with memcmp() on equal paths, which is the cost of a
+ * hit. path_bytes_equal() is memcmp(), the comparison shows that libc's
+ * runtime dispatched version is what oci-umount gets.
+ *
+ * usage: pathcmp-bench [-m mounts] [-n lookups]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/pathcmp.h"
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static char *make_path(unsigned i)
+{
+	static const char *const fmt[] = {
+		"/var/lib/docker/overlay2/%064x/merged",
+		"/var/lib/docker/containers/%064x/mounts/shm",
+		"/var/lib/docker/overlay2/%064x-init/merged",
+	};
+	char *path;
+
+	/* Ids differ only near the end, like hex ids sharing a prefix do */
+	if (asprintf(&path, fmt[i % 3], i * 2654435761u) < 0) {
+		perror("asprintf");
+		exit(EXIT_FAILURE);
+	}
+	return path;
+}
+
+/* Keep compiler from optimizing away results */
+static volatile size_t sink;
+
+int main(int argc, char *argv[])
+{
+	unsigned nr_mounts = 1000, nr_lookups = 2000, i, j;
+	struct path_sig *sigs, qsig;
+	char **table, **queries;
+	size_t found;
+	double t;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "m:n:")) != -1) {
+		switch (opt) {
+		case 'm':
+			nr_mounts = atoi(optarg);
+			break;
+		case 'n':
+			nr_lookups = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-m mounts] [-n lookups]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (!nr_mounts || !nr_lookups) {
+		fprintf(stderr, "mounts and lookups must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	table = malloc(nr_mounts * sizeof(*table));
+	sigs = malloc(nr_mounts * sizeof(*sigs));
+	queries = malloc(nr_lookups * sizeof(*queries));
+	if (!table || !sigs || !queries) {
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < nr_mounts; i++) {
+		table[i] = make_path(i);
+		path_sig_init(&sigs[i], table[i]);
+	}
+	/* Half of lookups hit, half miss */
+	for (i = 0; i < nr_lookups; i++)
+		queries[i] = make_path(i % 2 ? nr_mounts + i : (i / 2) % nr_mounts);
+
+	printf("%u mounts, %u lookups, %zu byte paths\n", nr_mounts, nr_lookups, strlen(table[0]));
+
+	/* Warm up caches and let libc resolve memcmp() */
+	for (i = 0, found = 0; i < nr_lookups; i++)
+		found += !memcmp(queries[i], table[i % nr_mounts], strlen(queries[i]));
+	sink = found;
+
+	found = 0;
+	t = now_ns();
+	for (i = 0; i < nr_lookups; i++) {
+		for (j = 0; j < nr_mounts; j++) {
+			if (!strcmp(table[j], queries[i])) {
+				found++;
+				break;
+			}
+		}
+	}
+	t = now_ns() - t;
+	sink = found;
+	printf("lookup strcmp:          %8.1f ns/lookup (%zu hits)\n", t / nr_lookups, found);
+
+	found = 0;
+	t = now_ns();
+	for (i = 0; i < nr_lookups; i++) {
+		path_sig_init(&qsig, queries[i]);
+		for (j = 0; j < nr_mounts; j++) {
+			if (path_equal(table[j], &sigs[j], queries[i], &qsig)) {
+				found++;
+				break;
+			}
+		}
+	}
+	t = now_ns() - t;
+	sink = found;
+	printf("lookup length+hash:     %8.1f ns/lookup (%zu hits)\n", t / nr_lookups, found);
+
+	/* Equal paths, in different buffers, so every byte is compared */
+	found = 0;
+	t = now_ns();
+	for (j = 0; j < 100; j++) {
+		for (i = 0; i < nr_lookups; i += 2)
+			found += !memcmp(queries[i], table[(i / 2) % nr_mounts], strlen(queries[i]));
+	}
+	t = now_ns() - t;
+	sink = found;
+	printf("equal memcmp:           %8.1f ns/compare\n", t / (found ? found : 1));
+
+	found = 0;
+	t = now_ns();
+	for (j = 0; j < 100; j++) {
+		for (i = 0; i < nr_lookups; i += 2)
+			found += path_bytes_equal(queries[i], table[(i / 2) % nr_mounts], strlen(queries[i]));
+	}
+	t = now_ns() - t;
+	sink = found;
+	printf("equal path_bytes_equal: %8.1f ns/compare\n", t / (found ? found : 1));
+
+	for (i = 0; i < nr_mounts; i++)
+		free(table[i]);
+	for (i = 0; i < nr_lookups; i++)
+		free(queries[i]);
+	free(table);
+	free(sigs);
+	free(queries);
+	return EXIT_SUCCESS;
+}
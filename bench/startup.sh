@@ -0,0 +1,106 @@
+#!/bin/bash
+#
+# Benchmark exec-to-exit time and page faults of one or more oci-umount
+# binaries, e.g. a default and a --enable-fast-startup build. Also used as
+# training run for "make pgo".
+#
+# Needs root. Everything runs in a mount namespace of its own, so host's
+# mount table and /etc are left alone. In there a throw away bundle
+# is set up, a conf bind mounted over /etc/oci-umount.conf, and a container
+# process started in a nested mount namespace with overlay2 style mounts
+# under its rootfs. Each binary then runs as prestart hook against it.
+#
+# Before every run (untimed) the container's mounts are set up again, so
+# every run does the full work: parsing inputs, matching the container's
+# mount table, joining its namespace and unmounting.
+#
+# usage: startup.sh [-n runs] binary...
+#
+# EXEC_BENCH points to exec-bench binary (default ./exec-bench).
+
+set -e
+
+RUNS=1000
+if [ "$1" = "-n" ]; then
+	RUNS=$2
+	shift 2
+fi
+
+if [ $# -eq 0 ]; then
+	echo "usage: $0 [-n runs] binary..." >&2
+	exit 1
+fi
+
+EXEC_BENCH=${EXEC_BENCH:-./exec-bench}
+CONF=/etc/oci-umount.conf
+TMP=$(mktemp -d)
+CREATED_CONF=
+
+cleanup() {
+	[ -n "$CREATED_CONF" ] && rm -f "$CONF"
+	rm -rf "$TMP"
+}
+trap cleanup EXIT
+
+# Mount point for the conf, if host has none
+if [ ! -e "$CONF" ]; then
+	touch "$CONF"
+	CREATED_CONF=1
+fi
+
+mkdir -p "$TMP/rootfs/var/lib/docker" "$TMP/bundle"
+cat > "$TMP/bundle/config.json" <<JSON
+{
+	"root": { "path": "$TMP/rootfs" },
+	"mounts": [
+		{ "destination": "/proc", "source": "proc" },
+		{ "destination": "/var/lib/docker", "source": "$TMP/host/docker" },
+		{ "destination": "/var/lib/containers", "source": "/var/lib/containers" },
+		{ "destination": "/run/containers", "source": "/var/run/containers" },
+		{ "destination": "/data", "source": "/var/lib" }
+	]
+}
+JSON
+
+# Entries of the shipped conf, which mostly don't exist, plus the bench's
+cat > "$TMP/oci-umount.conf" <<CONF
+/var/lib/docker/overlay2
+/var/lib/docker/devicemapper
+/var/lib/docker-latest/overlay2
+/var/lib/docker-latest/devicemapper
+/var/lib/containers/storage/overlay2
+/var/lib/containers/storage/devicemapper
+/run/containers/storage/overlay2-containers/*
+$TMP/host/docker/overlay2
+$TMP/host/docker/containers/*
+CONF
+
+export EXEC_BENCH RUNS CONF TMP
+unshare -m --propagation private bash -e -c '
+	mount --bind "$TMP/oci-umount.conf" "$CONF"
+
+	# Docker makes storage driver home a mount point of its own
+	mkdir -p "$TMP/host/docker/overlay2"
+	mount -t tmpfs none "$TMP/host/docker/overlay2"
+	for i in $(seq 16); do
+		mkdir -p "$TMP/host/docker/overlay2/l$i/merged" "$TMP/host/docker/containers/c$i/shm"
+		mount -t tmpfs none "$TMP/host/docker/overlay2/l$i/merged"
+		mount -t tmpfs none "$TMP/host/docker/containers/c$i/shm"
+	done
+
+	unshare -m --propagation private bash -c "
+		mount --rbind \"$TMP/host/docker\" \"$TMP/rootfs/var/lib/docker\"
+		exec sleep 3600" &
+	PID=$!
+	trap "kill $PID" EXIT
+	# Wait for the container to have its mounts
+	while ! grep -q " $TMP/rootfs/var/lib/docker " /proc/$PID/mountinfo 2>/dev/null; do
+		sleep 0.01
+	done
+
+	echo "{\"ociVersion\":\"1.0.0\",\"id\":\"0123456789abcdef0123456789abcdef\",\"pid\":$PID,\"bundle\":\"$TMP/bundle\"}" > "$TMP/state"
+
+	PREPARE="nsenter -t $PID -m sh -c \"umount -l $TMP/rootfs/var/lib/docker; mount --rbind $TMP/host/docker $TMP/rootfs/var/lib/docker\""
+	for bin in "$@"; do
+		"$EXEC_BENCH" -n "$RUNS" -i "$TMP/state" -p "$PREPARE" -- "$bin" prestart
+	done' startup.sh "$@"
@@ -20,8 +20,7 @@ Source0:        https://%{provider_prefix}/archive/%{commit}/%{repo}-%{shortcomm
 BuildRequires:  autoconf
 BuildRequires:  automake
 BuildRequires:  pkgconfig(yajl)
-BuildRequires:  pkgconfig(libselinux)
-BuildRequires:  pkgconfig(mount)
+BuildRequires:  systemtap-sdt-devel
 BuildRequires:  golang-github-cpuguy83-go-md2man
 
 %description
@@ -52,6 +51,7 @@ make %{?_smp_mflags}
 %dir /%{_sysconfdir}/containers/oci/hooks.d
 %dir /usr/share/containers/oci/hooks.d
 /usr/share/containers/oci/hooks.d/oci-umount.json
+/usr/share/containers/oci/hooks.d/oci-umount-plan.json
 
 %changelog
 * Wed Aug 16 2017 Dan Walsh <dwalsh@redhat.com> - 2.1.1
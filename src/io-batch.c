@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "io-batch.h"
+
+#ifdef USE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+void io_read_file(struct io_file *file)
+{
+	struct stat st;
+	size_t size, len = 0;
+	ssize_t nbytes;
+	char *data = NULL, *tmp;
+	int fd;
+
+	file->data = NULL;
+	file->len = 0;
+
+	fd = open(file->path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		file->err = errno;
+		return;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		file->err = errno;
+		goto out;
+	}
+
+	/* One extra byte to see EOF (and for NUL) in a single read */
+	size = (S_ISREG(st.st_mode) && st.st_size > 0) ? (size_t)st.st_size + 1 : 4096;
+	for (;;) {
+		tmp = realloc(data, size + 1);
+		if (!tmp) {
+			file->err = ENOMEM;
+			goto out;
+		}
+		data = tmp;
+
+		nbytes = read(fd, data + len, size - len);
+		if (nbytes < 0) {
+			if (errno == EINTR)
+				continue;
+			file->err = errno;
+			goto out;
+		}
+		if (nbytes == 0)
+			break;
+		len += nbytes;
+		if (len == size)
+			size *= 2;
+	}
+
+	data[len] = '\0';
+	file->data = data;
+	file->len = len;
+	file->err = 0;
+	data = NULL;
+out:
+	free(data);
+	close(fd);
+}
+
+#ifdef USE_IO_URING
+
+#define RING_ENTRIES 64
+
+struct ring {
+	int fd;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_sz, cq_sz;
+	unsigned pending;
+};
+
+static void ring_exit(struct ring *r)
+{
+	if (r->sqes)
+		munmap(r->sqes, RING_ENTRIES * sizeof(struct io_uring_sqe));
+	if (r->cq_ptr && r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_sz);
+	if (r->sq_ptr)
+		munmap(r->sq_ptr, r->sq_sz);
+	if (r->fd >= 0)
+		close(r->fd);
+}
+
+static int ring_init(struct ring *r)
+{
+	struct io_uring_params p;
+
+	memset(r, 0, sizeof(*r));
+	memset(&p, 0, sizeof(p));
+
+	r->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+	if (r->fd < 0)
+		return -1;
+
+	r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (r->cq_sz > r->sq_sz)
+			r->sq_sz = r->cq_sz;
+		r->cq_sz = r->sq_sz;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ptr == MAP_FAILED) {
+		r->sq_ptr = NULL;
+		goto fail;
+	}
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ptr = r->sq_ptr;
+	} else {
+		r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (r->cq_ptr == MAP_FAILED) {
+			r->cq_ptr = NULL;
+			goto fail;
+		}
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ptr + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+	return 0;
+fail:
+	ring_exit(r);
+	return -1;
+}
+
+/* Get next free sqe. Callers never queue more than RING_ENTRIES at once. */
+static struct io_uring_sqe *ring_get_sqe(struct ring *r, uint64_t user_data)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned idx = tail & *r->sq_mask;
+	struct io_uring_sqe *sqe = &r->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = user_data;
+	r->sq_array[idx] = idx;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->pending++;
+	return sqe;
+}
+
+/* Wait till there are nr completions in the ring, returns how many there are */
+static unsigned ring_wait(struct ring *r, unsigned nr)
+{
+	for (;;) {
+		unsigned ready = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE) - *r->cq_head;
+		int ret;
+
+		if (ready >= nr)
+			return ready;
+		ret = syscall(__NR_io_uring_enter, r->fd, 0, nr - ready, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0 && errno != EINTR)
+			return ready;
+	}
+}
+
+/*
+ * Submit everything queued and wait for all of it to complete. Returns -1
+ * if not everything could be submitted. Whatever was submitted is waited
+ * for even then, as kernel may still write to buffers of caller.
+ */
+static int ring_submit_and_wait(struct ring *r)
+{
+	unsigned queued = r->pending;
+	int ret = 0;
+
+	while (r->pending) {
+		ret = syscall(__NR_io_uring_enter, r->fd, r->pending, queued, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		r->pending -= ret;
+	}
+
+	if (ring_wait(r, queued - r->pending) < queued || r->pending)
+		return -1;
+	return 0;
+}
+
+/* Pop one completion. Only called when completions are known to be there */
+static void ring_pop_cqe(struct ring *r, uint64_t *user_data, int *res)
+{
+	unsigned head = *r->cq_head;
+	struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+}
+
+bool io_batch_stat(struct io_stat *stats, unsigned nr)
+{
+	struct statx stx[RING_ENTRIES];
+	struct io_uring_sqe *sqe;
+	struct ring r;
+	unsigned i, done, n;
+
+	if (nr < 2 || ring_init(&r) < 0)
+		return false;
+
+	for (done = 0; done < nr; done += n) {
+		n = nr - done < RING_ENTRIES ? nr - done : RING_ENTRIES;
+
+		for (i = 0; i < n; i++) {
+			sqe = ring_get_sqe(&r, i);
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (uintptr_t)stats[done + i].path;
+			sqe->len = STATX_TYPE;
+			sqe->off = (uintptr_t)&stx[i];
+			sqe->statx_flags = AT_STATX_SYNC_AS_STAT;
+		}
+
+		if (ring_submit_and_wait(&r) < 0) {
+			ring_exit(&r);
+			return false;
+		}
+
+		for (i = 0; i < n; i++) {
+			uint64_t user_data;
+			int res;
+
+			ring_pop_cqe(&r, &user_data, &res);
+			stats[done + user_data].err = res < 0 ? -res : 0;
+		}
+	}
+	ring_exit(&r);
+	return true;
+}
+
+#else /* !USE_IO_URING */
+
+bool io_batch_stat(struct io_stat *stats, unsigned nr)
+{
+	(void)stats;
+	(void)nr;
+	return false;
+}
+
+#endif /* USE_IO_URING */
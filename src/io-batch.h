@@ -0,0 +1,37 @@
+#ifndef IO_BATCH_H
+#define IO_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * File I/O helpers. When built with USE_IO_URING and the kernel allows it,
+ * independent stats are submitted together through one io_uring instead of
+ * one blocking syscall at a time.
+ */
+
+/* A file to be read whole */
+struct io_file {
+	const char *path;
+	char *data;	/* NUL terminated content, NULL on error. Caller frees. */
+	size_t len;
+	int err;	/* errno if data is NULL */
+};
+
+/* A path to be checked for existence */
+struct io_stat {
+	const char *path;
+	int err;	/* 0 if path exists, errno otherwise */
+};
+
+/* Read whole file with plain syscalls */
+void io_read_file(struct io_file *file);
+
+/*
+ * Stat all paths in one go. Returns false if batching is not available, in
+ * which case nothing is done, as doing the same one by one is no better
+ * than letting the caller find out on its own.
+ */
+bool io_batch_stat(struct io_stat *stats, unsigned nr);
+
+#endif /* IO_BATCH_H */
@@ -12,41 +12,132 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <poll.h>
 #include <unistd.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <linux/limits.h>
-#include <selinux/selinux.h>
 #include <yajl/yajl_tree.h>
 #include <ctype.h>
 
 #include "config.h"
+#include "io-batch.h"
+#include "pathcmp.h"
+#include "pathglob.h"
+#include "probes.h"
 
 #define _cleanup_(x) __attribute__((cleanup(x)))
 
 #define MOUNTCONF "/etc/oci-umount.conf"
 #define MOUNTINFO_PATH "/proc/self/mountinfo"
+#define PLAN_FILE "oci-umount.plan"	/* Precomputed plan, in bundle dir */
+#define PLAN_VERSION 3
 #define MAX_UMOUNTS	128	/* Maximum number of unmounts */
 #define MAX_MAPS	128	/* Maximum number of source to dest mappings */
 
-/* Basic mount info. For now we need only destination */
-struct mount_info {
-	char *destination;
-	unsigned mntid;
-	unsigned parent_mntid;
+/* Per container annotations in config.json */
+#define ANNOTATION_SKIP "io.projectatomic.oci-umount.skip"	/* "true" to skip hook */
+#define ANNOTATION_ADD "io.projectatomic.oci-umount.add"	/* extra paths */
+#define ANNOTATION_ONLY "io.projectatomic.oci-umount.only"	/* restrict to paths */
+
+/*
+ * Mount table, laid out as structure of arrays. For mount i, ids, hash and
+ * length of destination are in mntid[i], parent_mntid[i], hash[i] and
+ * len[i], and destination itself is at pool + off[i]. All destinations are
+ * packed one after another (NUL terminated) in pool. That way a scan of
+ * the table touches a few contiguous arrays instead of chasing a pointer to
+ * a separate allocation for every mount.
+ */
+struct mount_table {
+	size_t nr;
+	size_t capacity;
+	unsigned *mntid;
+	unsigned *parent_mntid;
+	uint32_t *hash;
+	uint32_t *len;
+	uint32_t *off;
+	char *pool;
+	size_t pool_sz;
+	size_t pool_capacity;
 };
 
+static inline const char *mnt_path(const struct mount_table *mt, size_t i)
+{
+	return mt->pool + mt->off[i];
+}
+
 /* Basic config mount info */
 struct config_mount_info {
 	char *source;
 	char *destination;
+	struct path_sig source_sig;
 };
 
+/*
+ * oci-umount.conf entry. path is canonicalized leading part of the entry
+ * without wildcards, glob is pattern for the rest (NULL if none).
+ */
 struct host_mount_info {
 	char *path;
-	bool submounts_only;
+	char *glob;
+};
+
+/*
+ * Per container overrides from config.json annotations. add and only are
+ * comma separated lists of host paths in oci-umount.conf format.
+ */
+struct container_overrides {
+	bool skip;
+	char *add;
+	char *only;
+};
+
+/*
+ * Unmount plan of a container. Patterns (see pathglob.h) are for absolute
+ * paths on host (rootfs included) of mounts which need to be unmounted in
+ * container's mount namespace.
+ */
+struct umount_plan {
+	char **patterns;
+	unsigned nr;
+	unsigned capacity;
+};
+
+/*
+ * In-memory view of the host used by long lived (batch) mode. fd is kept
+ * open on host's mountinfo and polled for changes. mounts has the
+ * canonicalized config entries, the same as prestart uses. It is rebuilt
+ * only when kernel signals that host mount table changed, as mounts are
+ * what can make paths canonicalize differently.
+ */
+struct host_view {
+	int fd;
+	bool valid;
+	struct host_mount_info *mounts;
+	int nr_umounts;
+};
+
+/*
+ * Canonicalizations of host paths a plan depends on, recorded while the
+ * plan is computed, so that prestart can tell whether symlinks on host or
+ * existence of paths changed since. real is NULL if raw could not be
+ * canonicalized.
+ */
+struct canon_entry {
+	char *raw;
+	char *real;
+};
+
+struct canon_log {
+	struct canon_entry *entries;
+	unsigned nr;
+	unsigned capacity;
+	bool failed;	/* Something could not be recorded */
 };
 
+/* Where add_host_mount_path() records to, NULL if not computing a plan */
+static struct canon_log *canon_log;
+
 static inline void freep(void *p) {
 	free(*(void**) p);
 }
@@ -63,17 +154,14 @@ static inline void fclosep(FILE **fp) {
 	*fp = NULL;
 }
 
-static inline void free_mnt_info(struct mount_info **p) {
-	unsigned i;
-	struct mount_info *mi = *p;
-
-	if (mi == NULL)
-		return;
-
-	for (i = 0; mi[i].destination; i++) {
-		free(mi[i].destination);
-	}
-	free(mi);
+static inline void free_mount_table(struct mount_table *mt) {
+	free(mt->mntid);
+	free(mt->parent_mntid);
+	free(mt->hash);
+	free(mt->len);
+	free(mt->off);
+	free(mt->pool);
+	memset(mt, 0, sizeof(*mt));
 }
 
 static inline void free_host_mounts(struct host_mount_info **p) {
@@ -85,6 +173,7 @@ static inline void free_host_mounts(struct host_mount_info **p) {
 
 	for (i = 0; hmi[i].path; i++) {
 		free(hmi[i].path);
+		free(hmi[i].glob);
 	}
 	free(hmi);
 }
@@ -119,13 +208,45 @@ static inline void free_config_mounts(struct config_mount_info **p) {
 	free(cm);
 }
 
+static inline void free_overrides(struct container_overrides *ov) {
+	free(ov->add);
+	free(ov->only);
+	ov->add = ov->only = NULL;
+}
+
+static inline void free_plan(struct umount_plan *plan) {
+	for (unsigned i = 0; i < plan->nr; i++)
+		free(plan->patterns[i]);
+	free(plan->patterns);
+	memset(plan, 0, sizeof(*plan));
+}
+
+static inline void free_canon_log(struct canon_log *log) {
+	for (unsigned i = 0; i < log->nr; i++) {
+		free(log->entries[i].raw);
+		free(log->entries[i].real);
+	}
+	free(log->entries);
+	memset(log, 0, sizeof(*log));
+}
+
+static inline void free_io_file(struct io_file *file) {
+	free(file->data);
+	file->data = NULL;
+}
+
 #define _cleanup_free_ _cleanup_(freep)
 #define _cleanup_close_ _cleanup_(closep)
 #define _cleanup_fclose_ _cleanup_(fclosep)
-#define _cleanup_mnt_info_ _cleanup_(free_mnt_info)
+#define _cleanup_mount_table_ _cleanup_(free_mount_table)
 #define _cleanup_host_mounts_ _cleanup_(free_host_mounts)
 #define _cleanup_cptr_array_ _cleanup_(free_cptr_array)
 #define _cleanup_config_mounts_ _cleanup_(free_config_mounts)
+#define _cleanup_overrides_ _cleanup_(free_overrides)
+#define _cleanup_plan_ _cleanup_(free_plan)
+#define _cleanup_io_file_ _cleanup_(free_io_file)
+#define _cleanup_glob_set_ _cleanup_(glob_set_free)
+#define _cleanup_canon_log_ _cleanup_(free_canon_log)
 
 #define DEFINE_CLEANUP_FUNC(type, func)                         \
 	static inline void func##p(type *p) {                   \
@@ -166,56 +287,92 @@ int iscomment(const char *line) {
 	return 1;
 }
 
-static void *grow_mountinfo_table(void *curr_table, size_t curr_sz, size_t new_sz) {
-	void *table;
+/* Make room for at least one more mount and len bytes of path in pool */
+static int grow_mount_table(struct mount_table *mt, size_t len)
+{
+	if (mt->nr == mt->capacity) {
+		size_t capacity = mt->capacity ? mt->capacity * 2 : 64;
+		void *p;
+
+#define GROW_ARRAY(field) \
+		p = realloc(mt->field, capacity * sizeof(*mt->field)); \
+		if (!p) \
+			return -1; \
+		mt->field = p;
+
+		GROW_ARRAY(mntid)
+		GROW_ARRAY(parent_mntid)
+		GROW_ARRAY(hash)
+		GROW_ARRAY(len)
+		GROW_ARRAY(off)
+#undef GROW_ARRAY
+		mt->capacity = capacity;
+	}
+
+	if (mt->pool_sz + len > mt->pool_capacity) {
+		size_t capacity = mt->pool_capacity ? mt->pool_capacity * 2 : 4096;
+		char *pool;
 
-	table = realloc(curr_table, new_sz);
-	if (!table)
-		return NULL;
+		while (capacity < mt->pool_sz + len)
+			capacity *= 2;
+		pool = realloc(mt->pool, capacity);
+		if (!pool)
+			return -1;
+		mt->pool = pool;
+		mt->pool_capacity = capacity;
+	}
+	return 0;
+}
+
+/*
+ * Give back space over allocated while growing. If realloc() fails, old
+ * and bigger allocation stays which is harmless.
+ */
+static void trim_mount_table(struct mount_table *mt)
+{
+	void *p;
+
+	if (!mt->nr)
+		return;
 
-	/* Zero newly allocated area */
-	memset(table + curr_sz, 0, (new_sz - curr_sz));
-	return table;
+#define TRIM_ARRAY(field) \
+	p = realloc(mt->field, mt->nr * sizeof(*mt->field)); \
+	if (p) \
+		mt->field = p;
+
+	TRIM_ARRAY(mntid)
+	TRIM_ARRAY(parent_mntid)
+	TRIM_ARRAY(hash)
+	TRIM_ARRAY(len)
+	TRIM_ARRAY(off)
+#undef TRIM_ARRAY
+	mt->capacity = mt->nr;
+
+	p = realloc(mt->pool, mt->pool_sz);
+	if (p)
+		mt->pool = p;
+	mt->pool_capacity = mt->pool_sz;
 }
 
-static int parse_mountinfo(const char *id, struct mount_info **info, size_t *sz)
+static int parse_mountinfo(const char *id, const char *mountinfo, struct mount_table *table)
 {
 	_cleanup_fclose_ FILE *fp;
-	_cleanup_mnt_info_ struct mount_info *mnt_table = NULL;
-	struct mount_info *mnt_table_temp;
-	int nr_elem = 64;
-	int elem_sz = sizeof(struct mount_info);
-	/*
-	 * table size bytes also keeps track of last zero element while
-	 * nr_elem does not
-	 */
-	size_t table_sz_bytes = (nr_elem + 1) * elem_sz;
+	_cleanup_mount_table_ struct mount_table mt = { 0 };
 	_cleanup_free_ char *line = NULL;
 	size_t len = 0;
-	int table_idx = 0;
 
-	fp = fopen(MOUNTINFO_PATH, "r");
+	PROBE1(mountinfo__start, id);
+	fp = fopen(mountinfo, "r");
 	if (!fp) {
-		pr_perror("%s: Failed to open %s %m", id, MOUNTINFO_PATH);
-		return -1;
-	}
-
-	/*
-	 * Alaways allocate one member extra at the end and keep it zero so
-	 * that cleanup function can find the end of array.
-	 */
-	mnt_table = (struct mount_info *)realloc(NULL, table_sz_bytes);
-	if (!mnt_table) {
-		pr_perror("%s: Failed to allocate memory for mount tabel", id);
+		pr_perror("%s: Failed to open %s %m", id, mountinfo);
 		return -1;
 	}
 
-	memset(mnt_table, 0, table_sz_bytes);
-
 	while ((getline(&line, &len, fp)) != -1) {
-		char *token, *str = line, *dest;
+		char *token, *str = line;
 		int token_idx = 0;
 		unsigned mntid, parent_mntid;
+		struct path_sig sig;
 
 		mntid = parent_mntid = 0;
 		while ((token = strtok(str, " ")) != NULL) {
@@ -228,58 +385,44 @@ static int parse_mountinfo(const char *id, struct mount_info **info, size_t *sz)
 			if (token_idx != 5)
 			       continue;
 
-			dest = strdup(token);
-			if (!dest) {
-				pr_perror("%s: strdup(%s) failed", id, token);
+			path_sig_init(&sig, token);
+			if (grow_mount_table(&mt, sig.len + 1) < 0) {
+				pr_perror("%s: Failed to realloc mountinfo table", id);
 				return -1;
 			}
 
-			mnt_table[table_idx].destination = dest;
-			mnt_table[table_idx].mntid = mntid;
-			mnt_table[table_idx].parent_mntid = parent_mntid;
-			table_idx++;
-			if (table_idx == nr_elem) {
-				int new_sz_bytes = table_sz_bytes + elem_sz * 64;
-				mnt_table_temp = grow_mountinfo_table(mnt_table, table_sz_bytes, new_sz_bytes);
-				if (!mnt_table_temp) {
-					pr_perror("%s: Failed to realloc mountinfo table", id);
-					return -1;
-				}
-				mnt_table = mnt_table_temp;
-				table_sz_bytes = new_sz_bytes;
-				nr_elem += 64;
-			}
+			memcpy(mt.pool + mt.pool_sz, token, sig.len + 1);
+			mt.off[mt.nr] = mt.pool_sz;
+			mt.len[mt.nr] = sig.len;
+			mt.hash[mt.nr] = sig.hash;
+			mt.mntid[mt.nr] = mntid;
+			mt.parent_mntid[mt.nr] = parent_mntid;
+			mt.pool_sz += sig.len + 1;
+			mt.nr++;
 		}
 	}
 
-	*info = mnt_table;
-	*sz = table_idx;
+	trim_mount_table(&mt);
+	PROBE2(mountinfo__done, id, mt.nr);
+	*table = mt;
 	/* Make sure cleanup function does not free up this table now */
-	mnt_table = NULL;
+	memset(&mt, 0, sizeof(mt));
 	return 0;
 }
 
-static bool is_mounted(char *path, const struct mount_info *mnt_table, size_t table_sz) {
-	size_t i;
-
-	for (i = 0; i < table_sz; i++) {
-		if (!strcmp(mnt_table[i].destination, path))
-			return true;
-	}
-	return false;
-}
-
 /* return <0 on failure otherwise 0.  */
 static int map_one_entry(const char *id, const struct config_mount_info *config_mounts, unsigned config_mounts_len, char *host_mnt, char **cont_mnt, unsigned max_mapped, char *suffix, unsigned *nr_mapped) {
 	char *str, *dest;
 	unsigned i, suffix_len = 0;
 	char path[PATH_MAX];
+	struct path_sig host_sig;
 
 	if (suffix)
 		suffix_len = strlen(suffix);
 
+	path_sig_init(&host_sig, host_mnt);
 	for (i = 0; i < config_mounts_len; i++) {
-		if (strcmp(host_mnt, config_mounts[i].source))
+		if (!path_equal(host_mnt, &host_sig, config_mounts[i].source, &config_mounts[i].source_sig))
 			continue;
 
 		dest = config_mounts[i].destination;
@@ -355,278 +498,955 @@ static int map_mount_host_to_container(const char *id, const struct config_mount
 		pr_pinfo("%s: mapped host_mnt=%s to cont_mnt=%s", id, host_mnt, cont_mnt[i]);
 	}
 
+	PROBE3(map__done, id, host_mnt, nr_mapped);
 	return nr_mapped;
 }
 
-/*
- * Given a mount path, gets its mount id from mountinfo table. If a mount is
- * found, mount id is returned, otherwise -1 is returned
- */
-static int find_mntid(char *path, const struct mount_info *mnt_table, size_t table_sz)
+struct mntid_index {
+	unsigned mntid;
+	unsigned idx;
+};
+
+static int cmp_mntid_index(const void *a, const void *b)
 {
-	unsigned i;
+	unsigned x = ((const struct mntid_index *)a)->mntid;
+	unsigned y = ((const struct mntid_index *)b)->mntid;
 
-	for (i = 0; i < table_sz; i++) {
-		if (!strcmp(path, mnt_table[i].destination)) {
-			return mnt_table[i].mntid;
-		}
-	}
+	return x < y ? -1 : x > y;
+}
+
+/* Returns index of mount with parent of mount i in mt, -1 if not there */
+static ssize_t parent_idx(const struct mntid_index *index, const struct mount_table *mt, size_t i)
+{
+	struct mntid_index key = { .mntid = mt->parent_mntid[i] }, *found;
 
-	return -1;
+	found = bsearch(&key, index, mt->nr, sizeof(*index), cmp_mntid_index);
+	return found ? (ssize_t)found->idx : -1;
 }
 
 /*
- * Find mount id of parent mount of a path. If path itself is a mount point,
- * then mount id of that mount is returned. Otherwise we travel up the path
- * and see try to find which part of it is mounted
+ * Set *matched to a newly allocated array telling which mounts in mt match
+ * one of patterns. Returns the number of matches, -1 on failure.
  */
-static int parent_mntid(const char *id, char *path, const struct mount_info *mnt_table, size_t table_sz)
+static ssize_t match_mounts(const char *id, const struct glob_set *patterns, const struct mount_table *mt, bool **matched)
 {
-	_cleanup_free_ char *path_copy = NULL;
-	char *dname;
-	int mntid;
+	_cleanup_free_ const char **paths = NULL;
+	ssize_t nr = 0;
+	size_t i;
 
-	path_copy = strdup(path);
-	if (!path_copy) {
-		pr_perror("%s: strdup(%s) failed: %s", id, path, strerror(errno));
+	*matched = calloc(mt->nr + 1, sizeof(**matched));
+	paths = malloc((mt->nr + 1) * sizeof(*paths));
+	if (!*matched || !paths) {
+		pr_perror("%s: Failed to malloc memory for matching mounts", id);
+		freep(matched);
+		*matched = NULL;
 		return -1;
 	}
 
-	dname = path_copy;
-
-	while(1) {
-		mntid = find_mntid(dname, mnt_table, table_sz);
-		if (mntid >= 0) {
-			return mntid;
-		}
-
-		if (!strcmp(dname, "/"))
-			break;
+	for (i = 0; i < mt->nr; i++)
+		paths[i] = mnt_path(mt, i);
 
-		/* Path is not a mount point. Go one level up */
-		dname = dirname(dname);
-		if (!strcmp(dname, "."))
-			break;
+	if (glob_set_match(patterns, paths, mt->nr, *matched) < 0) {
+		pr_perror("%s: Failed to match mount table", id);
+		freep(matched);
+		*matched = NULL;
+		return -1;
 	}
 
-	return -1;
+	for (i = 0; i < mt->nr; i++)
+		nr += (*matched)[i];
+	return nr;
 }
 
-/* Returns 0 on success, negative error otherwise */
-static int unmount(const char *id, char *umount_path, bool submounts_only, const struct mount_info *mnt_table, size_t table_sz)
+/*
+ * Detach every mount in mt which matched (see match_mounts()), in one pass
+ * over the table. A match is left alone if a mount above it in mount tree, at a
+ * different path, matches too, as detaching that takes it along. Mounts
+ * are detached newest first, so that a mount hiding an older one is gone
+ * by the time the older one is reached.
+ *
+ * For Example. Try following.
+ * mount -t tmpfs none foo1/foo2
+ * mount -t tmpfs none foo1
+ *
+ * foo1/foo2 can only be reached after foo1 is unmounted. /proc/self/mountinfo
+ * seems to be time ordered and we are relying on that.
+ *
+ * Returns 0 on success, -1 if anything failed.
+ */
+static int unmount_matching(const char *id, const struct mount_table *mt, const bool *matched)
 {
-	int ret, i;
-	int mntid = 0;
+	_cleanup_free_ struct mntid_index *index = NULL;
+	size_t i, steps;
+	ssize_t j;
+	int ret = 0;
 
-	if (!submounts_only) {
-		if (!is_mounted((char *)umount_path, mnt_table, table_sz)) {
-			pr_pinfo("[%s] is not a mountpoint. Skipping.", umount_path);
-			return 0;
-		}
+	if (!mt->nr)
+		return 0;
 
-		ret = umount2(umount_path, MNT_DETACH);
-		if (!ret)
-			pr_pinfo("%s: Unmounted: [%s]", id, umount_path);
-		else
-			pr_perror("%s: Failed to unmount: [%s]", id, umount_path);
-		return ret;
+	index = malloc(mt->nr * sizeof(*index));
+	if (!index) {
+		pr_perror("%s: Failed to malloc memory for mount id index", id);
+		return -1;
 	}
 
-	/* Unmount submounts only */
-	mntid = parent_mntid(id, umount_path, mnt_table, table_sz);
-	if (mntid < 0) {
-		pr_perror("%s: Could not determine mount id of path: [%s]", id, umount_path);
-		return -1;
+	for (i = 0; i < mt->nr; i++) {
+		index[i].mntid = mt->mntid[i];
+		index[i].idx = i;
 	}
+	qsort(index, mt->nr, sizeof(*index), cmp_mntid_index);
 
-	/*
-	 * lazy unmount all direct submounts. Traverse in reverse order so that
-	 * if two child have same parent but one child masks other child, we
-	 * get to unmount top level child first
-	 *
-	 * For Example. Try following.
-	 * mount -t tmpfs none foo1/foo2
-	 * mount -t tmpfs none foo1
-	 *
-	 * Here both foo1 and foo2 are child of same parent. But we want
-	 * to unmount foo1 first and foo2 later. /proc/self/mountinfo seems
-	 * to be time ordered and we are relying on that. If not, this logic
-	 * will be broken.
-	 */
-	for (i = table_sz - 1; i >= 0; i--) {
-		if (mnt_table[i].parent_mntid != (unsigned)mntid)
+	for (i = mt->nr; i-- > 0; ) {
+		const char *path = mnt_path(mt, i);
+		bool covered = false;
+
+		if (!matched[i])
 			continue;
 
-		/* This mount has to be submount of path specified */
-		if (strncmp(umount_path, mnt_table[i].destination, strlen(umount_path))) {
+		/*
+		 * A matched ancestor covers this mount, unless it is mounted at
+		 * the same path (mount stacked on top of another). Bounded walk,
+		 * in case mountinfo changed under us into a loop.
+		 */
+		for (j = parent_idx(index, mt, i), steps = 0; j >= 0 && steps < mt->nr; j = parent_idx(index, mt, j), steps++) {
+			if (matched[j] && !(mt->hash[j] == mt->hash[i] && mt->len[j] == mt->len[i] &&
+					    path_bytes_equal(mnt_path(mt, j), path, mt->len[i]))) {
+				covered = true;
+				break;
+			}
+		}
+		if (covered) {
+			pr_pdebug("%s: [%s] goes along with a mount above it", id, path);
 			continue;
 		}
 
-		ret = umount2(mnt_table[i].destination, MNT_DETACH);
-		if (!ret)
-			pr_pinfo("%s: Unmounted submount: [%s]", id, mnt_table[i].destination);
-		else
-			pr_perror("%s: Failed to unmount submount: [%s]. Skipping.", id, mnt_table[i].destination);
+		if (umount2(path, MNT_DETACH) == 0) {
+			PROBE3(umount, id, path, 0);
+			pr_pinfo("%s: Unmounted: [%s]", id, path);
+		} else {
+			PROBE3(umount, id, path, errno);
+			pr_perror("%s: Failed to unmount: [%s]", id, path);
+			ret = -1;
+		}
 	}
-	return 0;
+	return ret;
 }
 
-static int prestart(
-	const char *id,
-	const char *rootfs,
-	int pid,
-	const struct config_mount_info *config_mounts,
-	unsigned config_mounts_len)
+/*
+ * Split oci-umount.conf entry in line at the first component with a
+ * wildcard. Returns leading part of the entry, which is a plain path, and
+ * sets *glob to the rest (NULL if there are no wildcards). line is modified.
+ */
+static const char *parse_conf_entry(char *line, const char **glob)
 {
-	pr_pinfo("prestart container_id:%s rootfs:%s", id, rootfs);
-	_cleanup_close_  int fd = -1;
-	_cleanup_free_   char *options = NULL;
+	char *comp = line, *end;
+
+	*glob = NULL;
+	for (; *comp; comp = end) {
+		while (*comp == '/')
+			comp++;
+		end = strchrnul(comp, '/');
+		if (strcspn(comp, "*?[") < (size_t)(end - comp)) {
+			*glob = comp;
+			break;
+		}
+	}
 
-	size_t mnt_table_sz;
-	_cleanup_mnt_info_ struct mount_info *mnt_table = NULL;
+	if (!*glob)
+		return line;
 
-	char process_mnt_ns_fd[PATH_MAX];
-	char umount_path[PATH_MAX];
-	_cleanup_fclose_ FILE *fp = NULL;
-	_cleanup_host_mounts_ struct host_mount_info *mounts_on_host = NULL;
-	_cleanup_cptr_array_ char **mapped_paths = NULL;
-	int nr_umounts = 0;
-	_cleanup_free_ char *line = NULL;
-	char *real_path;
-	size_t len = 0;
-	ssize_t read;
-	int i, ret, nr_mapped;
+	/* Entry has a wildcard right under root */
+	if (comp - line <= 1)
+		return "/";
 
-	/* Allocate one extra element and keep it zero for cleanup function */
-	mounts_on_host = malloc((MAX_UMOUNTS + 1) * sizeof(struct host_mount_info));
-	if (!mounts_on_host) {
-		pr_perror("%s: Failed to malloc memory for mounts_on_host table", id);
-		return EXIT_FAILURE;
-	}
-	memset((void *)mounts_on_host, 0, (MAX_UMOUNTS + 1) * sizeof(struct host_mount_info));
+	comp[-1] = '\0';
+	return line;
+}
 
-	/* Allocate one extra element and keep it zero for cleanup function */
-	mapped_paths = malloc((MAX_MAPS + 1) * sizeof(char *));
-	if (!mapped_paths) {
-		pr_perror("%s: Failed to malloc memory for mapped_paths array", id);
-		return EXIT_FAILURE;
-	}
-	memset((void *)mapped_paths, 0, (MAX_MAPS + 1) * sizeof(char *));
+/*
+ * Copy glob part of an entry. A trailing "*" component means all mounts
+ * underneath, as it did before patterns were supported, so it is turned
+ * into "**".
+ */
+static char *copy_glob(const char *glob)
+{
+	size_t len = strlen(glob);
+	char *copy = malloc(len + 2);
 
-	/* Parse oci-umounts.conf file, canonicalize path names and skip
-	 * paths which are not a mountpoint on host */
-	fp = fopen(MOUNTCONF, "r");
-	if (fp == NULL) {
-		if (errno == ENOENT) {
-			pr_pwarning("%s: Config file not found: %s", id, MOUNTCONF);
-			return 0;
+	if (!copy)
+		return NULL;
+
+	memcpy(copy, glob, len + 1);
+	if (glob[len - 1] == '*' && (len == 1 || glob[len - 2] == '/'))
+		strcpy(copy + len, "*");
+	return copy;
+}
+
+/* Record in canon_log, if any, that raw canonicalized to real (or failed) */
+static void canon_log_add(const char *raw, const char *real)
+{
+	struct canon_entry *e;
+
+	if (!canon_log || canon_log->failed)
+		return;
+
+	if (canon_log->nr == canon_log->capacity) {
+		unsigned capacity = canon_log->capacity ? canon_log->capacity * 2 : 16;
+
+		e = realloc(canon_log->entries, capacity * sizeof(*e));
+		if (!e) {
+			canon_log->failed = true;
+			return;
 		}
-		pr_perror("%s: Failed to open config file: %s", id, MOUNTCONF);
-		return EXIT_FAILURE;
+		canon_log->entries = e;
+		canon_log->capacity = capacity;
 	}
 
-	while ((read = getline(&line, &len, fp)) != -1) {
-		bool submounts_only = false;
+	e = &canon_log->entries[canon_log->nr];
+	e->raw = strdup(raw);
+	e->real = real ? strdup(real) : NULL;
+	if (!e->raw || (real && !e->real)) {
+		free(e->raw);
+		free(e->real);
+		canon_log->failed = true;
+		return;
+	}
+	canon_log->nr++;
+}
 
-		/* Get rid of newline character at the end */
-		line[read - 1] ='\0';
-		read--;
+/*
+ * Canonicalize path and append it to mounts along with glob. Paths which
+ * can not be canonicalized are skipped. Returns <0 if mounts is full or
+ * memory can't be allocated, otherwise 0.
+ */
+static int add_host_mount_path(const char *id, const char *path, const char *glob, struct host_mount_info *mounts, int *nr)
+{
+	char *real_path, *glob_copy = NULL;
 
-		if (iscomment(line))
-			continue;
+	real_path = realpath(path, NULL);
+	canon_log_add(path, real_path);
+	if (!real_path) {
+		pr_pinfo("%s: Failed to canonicalize path [%s]: %m. Skipping.", id, path);
+		return 0;
+	}
 
-		if (nr_umounts == MAX_UMOUNTS) {
-			pr_perror("%s: Exceeded maximum number of supported unmounts is %d", id, MAX_UMOUNTS);
-			return EXIT_FAILURE;
-		}
+	if (*nr == MAX_UMOUNTS) {
+		pr_perror("%s: Exceeded maximum number of supported unmounts is %d", id, MAX_UMOUNTS);
+		free(real_path);
+		return -1;
+	}
 
-		// If there is a "/*" at the end, only unmount submounts
-		if (read >= 2) {
-			if (line[read - 1] == '*' && line[read - 2] == '/') {
-				submounts_only = true;
-				line[read - 1] = '\0';
-			}
+	if (glob) {
+		glob_copy = copy_glob(glob);
+		if (!glob_copy) {
+			pr_perror("%s: Failed to copy pattern [%s]", id, glob);
+			free(real_path);
+			return -1;
 		}
+	}
 
-		real_path = realpath(line, NULL);
-		if (!real_path) {
-			pr_pinfo("%s: Failed to canonicalize path [%s]: %m. Skipping.", id, line);
-			continue;
-		}
+	mounts[*nr].path = real_path;
+	mounts[*nr].glob = glob_copy;
+	*nr += 1;
+	return 0;
+}
 
-		mounts_on_host[nr_umounts].path = real_path;
-		mounts_on_host[nr_umounts].submounts_only = submounts_only;
-		nr_umounts++;
-	}
+/*
+ * Parse one oci-umount.conf entry, canonicalize it and append it to mounts.
+ * line is modified. Returns <0 on failure, otherwise 0.
+ */
+static int add_host_mount(const char *id, char *line, struct host_mount_info *mounts, int *nr)
+{
+	const char *glob;
+	const char *path = parse_conf_entry(line, &glob);
 
-	if (!nr_umounts)
-		return 0;
+	return add_host_mount_path(id, path, glob, mounts, nr);
+}
 
-	snprintf(process_mnt_ns_fd, PATH_MAX, "/proc/%d/ns/mnt", pid);
+/*
+ * Parse comma separated list of oci-umount.conf entries, canonicalize them
+ * and append them to mounts. Returns <0 on failure, otherwise 0.
+ */
+static int add_host_mount_list(const char *id, const char *list, struct host_mount_info *mounts, int *nr)
+{
+	_cleanup_free_ char *dup = strdup(list);
+	char *saveptr = NULL, *token, *str;
 
-	fd = open(process_mnt_ns_fd, O_RDONLY);
-	if (fd < 0) {
-		pr_perror("%s: Failed to open mnt namespace fd %s", id, process_mnt_ns_fd);
-		return EXIT_FAILURE;
+	if (!dup) {
+		pr_perror("%s: strdup(%s) failed.", id, list);
+		return -1;
 	}
 
-	/* Join the mount namespace of the target process */
-	if (setns(fd, 0) == -1) {
-		pr_perror("%s: Failed to setns to %s", id, process_mnt_ns_fd);
-		return EXIT_FAILURE;
+	for (str = dup; (token = strtok_r(str, ",", &saveptr)) != NULL; str = NULL) {
+		if (add_host_mount(id, token, mounts, nr) < 0)
+			return -1;
 	}
+	return 0;
+}
 
-	/* Switch to the root directory */
-	if (chdir("/") == -1) {
-		pr_perror("%s: Failed to chdir", id);
-		return EXIT_FAILURE;
+/* Returns true if mount is same as one of nr entries in list */
+static bool host_mount_in(const struct host_mount_info *mount, const struct host_mount_info *list, int nr)
+{
+	for (int i = 0; i < nr; i++) {
+		if (strcmp(list[i].path, mount->path))
+			continue;
+		if (!list[i].glob != !mount->glob)
+			continue;
+		if (!mount->glob || !strcmp(list[i].glob, mount->glob))
+			return true;
 	}
+	return false;
+}
 
-	/* Parse mount table */
-	ret = parse_mountinfo(id, &mnt_table, &mnt_table_sz);
-	if (ret < 0) {
-		pr_perror("%s: Failed to parse mountinfo table", id);
+/*
+ * Apply container overrides to the host mounts set. Result is a new array
+ * which caller needs to free. Entries not in ov->only are dropped and
+ * entries in ov->add are appended.
+ */
+static int apply_overrides(const char *id, const struct container_overrides *ov, const struct host_mount_info *mounts, int nr_umounts, struct host_mount_info **result, int *nr_result)
+{
+	_cleanup_host_mounts_ struct host_mount_info *out = NULL;
+	_cleanup_host_mounts_ struct host_mount_info *only = NULL;
+	int i, nr = 0, nr_only = 0;
+
+	out = calloc(MAX_UMOUNTS + 1, sizeof(struct host_mount_info));
+	if (!out) {
+		pr_perror("%s: Failed to malloc memory for overridden mounts table", id);
 		return EXIT_FAILURE;
 	}
 
-	for (i = 0; i < nr_umounts; i++) {
-		nr_mapped = map_mount_host_to_container(id, config_mounts, config_mounts_len, mounts_on_host[i].path, mapped_paths, MAX_MAPS);
-		if (nr_mapped < 0) {
-			pr_perror("%s: Error while trying to map mount [%s] from host to conatiner. Skipping.", id, mounts_on_host[i].path);
-			continue;
+	/* Canonicalize only list once, not for every entry */
+	if (ov->only) {
+		only = calloc(MAX_UMOUNTS + 1, sizeof(struct host_mount_info));
+		if (!only) {
+			pr_perror("%s: Failed to malloc memory for %s table", id, ANNOTATION_ONLY);
+			return EXIT_FAILURE;
 		}
+		if (add_host_mount_list(id, ov->only, only, &nr_only) < 0)
+			return EXIT_FAILURE;
+	}
 
-		if (!nr_mapped) {
-			pr_pinfo("%s: Could not find mapping for mount [%s] from host to conatiner. Skipping.", id, mounts_on_host[i].path);
+	for (i = 0; i < nr_umounts; i++) {
+		if (ov->only && !host_mount_in(&mounts[i], only, nr_only)) {
+			pr_pinfo("%s: [%s] not in %s. Skipping.", id, mounts[i].path, ANNOTATION_ONLY);
 			continue;
 		}
-
-		for (int j = 0; j < nr_mapped; j++) {
-			snprintf(umount_path, PATH_MAX, "%s%s", rootfs, mapped_paths[j]);
-			ret = unmount(id, umount_path, mounts_on_host[i].submounts_only, mnt_table, mnt_table_sz);
-			if (ret < 0) {
-				pr_perror("%s: Skipping unmount path: [%s]", id, umount_path);
-				continue;
+		out[nr].path = strdup(mounts[i].path);
+		if (!out[nr].path) {
+			pr_perror("%s: strdup(%s) failed.", id, mounts[i].path);
+			return EXIT_FAILURE;
+		}
+		if (mounts[i].glob) {
+			out[nr].glob = strdup(mounts[i].glob);
+			if (!out[nr].glob) {
+				pr_perror("%s: strdup(%s) failed.", id, mounts[i].glob);
+				return EXIT_FAILURE;
 			}
 		}
-		free_char_ptr_array_entries(mapped_paths, nr_mapped);
+		nr++;
 	}
+
+	if (ov->add && add_host_mount_list(id, ov->add, out, &nr) < 0)
+		return EXIT_FAILURE;
+
+	*result = out;
+	*nr_result = nr;
+	out = NULL;
 	return 0;
 }
 
 /*
- * Read the entire content of stream pointed to by 'from' into a buffer in memory.
- * Return a pointer to the resulting NULL-terminated string.
+ * Parse oci-umounts.conf file, canonicalize path names and skip paths
+ * which do not exist on host. Returns 0 on success (with *nr_umounts set
+ * to 0 if there is no config file) and EXIT_FAILURE otherwise.
  */
-char *getJSONstring(FILE *from, size_t chunksize, char *msg)
+static int load_host_mounts(const char *id, struct host_mount_info **mounts, int *nr_umounts)
 {
-	struct stat stat_buf;
-	char *err = NULL, *JSONstring = NULL;
-	size_t nbytes, bufsize;
+	_cleanup_host_mounts_ struct host_mount_info *mounts_on_host = NULL;
+	_cleanup_io_file_ struct io_file conf = { .path = MOUNTCONF };
+	_cleanup_free_ struct io_stat *stats = NULL;
+	_cleanup_free_ const char **globs = NULL;
+	char *line, *next;
+	int i, nr = 0, nr_entries = 0, capacity = 0;
 
-	if (fstat(fileno(from), &stat_buf) == -1) {
-		err = "fstat failed";
-		goto fail;
+	*nr_umounts = 0;
+
+	/* Allocate one extra element and keep it zero for cleanup function */
+	mounts_on_host = malloc((MAX_UMOUNTS + 1) * sizeof(struct host_mount_info));
+	if (!mounts_on_host) {
+		pr_perror("%s: Failed to malloc memory for mounts_on_host table", id);
+		return EXIT_FAILURE;
+	}
+	memset((void *)mounts_on_host, 0, (MAX_UMOUNTS + 1) * sizeof(struct host_mount_info));
+
+	io_read_file(&conf);
+	if (!conf.data) {
+		if (conf.err == ENOENT) {
+			pr_pwarning("%s: Config file not found: %s", id, MOUNTCONF);
+			*mounts = mounts_on_host;
+			mounts_on_host = NULL;
+			return 0;
+		}
+		errno = conf.err;
+		pr_perror("%s: Failed to read config file: %s", id, MOUNTCONF);
+		return EXIT_FAILURE;
+	}
+
+	for (line = conf.data; line && *line; line = next) {
+		/* Get rid of newline character at the end */
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = '\0';
+
+		if (iscomment(line))
+			continue;
+
+		/*
+		 * Entries which don't exist are not counted against
+		 * MAX_UMOUNTS, so there can be any number of them.
+		 */
+		if (nr_entries == capacity) {
+			void *p;
+
+			capacity = capacity ? capacity * 2 : 32;
+			p = realloc(stats, capacity * sizeof(*stats));
+			if (p)
+				stats = p;
+			p = p ? realloc(globs, capacity * sizeof(*globs)) : NULL;
+			if (!p) {
+				pr_perror("%s: Failed to realloc memory for config entries", id);
+				return EXIT_FAILURE;
+			}
+			globs = p;
+		}
+
+		stats[nr_entries].path = parse_conf_entry(line, &globs[nr_entries]);
+		stats[nr_entries].err = 0;
+		nr_entries++;
+	}
+
+	/*
+	 * Find out in one go which entries do not exist, typically those of
+	 * storage drivers not in use, and don't bother canonicalizing them.
+	 */
+	io_batch_stat(stats, nr_entries);
+
+	for (i = 0; i < nr_entries; i++) {
+		if (stats[i].err) {
+			canon_log_add(stats[i].path, NULL);
+			pr_pinfo("%s: Failed to canonicalize path [%s]: %s. Skipping.", id, stats[i].path, strerror(stats[i].err));
+			continue;
+		}
+
+		if (add_host_mount_path(id, stats[i].path, globs[i], mounts_on_host, &nr) < 0)
+			return EXIT_FAILURE;
+	}
+
+	*mounts = mounts_on_host;
+	*nr_umounts = nr;
+	mounts_on_host = NULL;
+	return 0;
+}
+
+static void host_view_release(struct host_view *hv)
+{
+	free_host_mounts(&hv->mounts);
+	hv->mounts = NULL;
+	hv->nr_umounts = 0;
+	hv->valid = false;
+}
+
+static inline void host_view_destroy(struct host_view *hv)
+{
+	host_view_release(hv);
+	closep(&hv->fd);
+}
+
+#define _cleanup_host_view_ _cleanup_(host_view_destroy)
+
+/* Start watching host mount table. Must be called in host mount namespace */
+static int host_view_init(const char *id, struct host_view *hv)
+{
+	memset(hv, 0, sizeof(*hv));
+	hv->fd = open(MOUNTINFO_PATH, O_RDONLY | O_CLOEXEC);
+	if (hv->fd < 0) {
+		pr_perror("%s: Failed to open %s", id, MOUNTINFO_PATH);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Bring host view up to date. Kernel signals POLLPRI (and POLLERR) on an
+ * open mountinfo file when mount table of that namespace changes. If there
+ * is no such event since last refresh, current view is reused as is.
+ * Otherwise config entries are canonicalized again, as symlinks in them
+ * might resolve differently now. Entries are kept even if nothing is
+ * mounted at or under them on host any more, as containers may still have
+ * copies of mounts which were there. Must be called in host mount
+ * namespace.
+ */
+static int host_view_refresh(const char *id, struct host_view *hv)
+{
+	struct pollfd pfd = { .fd = hv->fd, .events = POLLPRI };
+	int ret;
+
+	ret = poll(&pfd, 1, 0);
+	if (ret < 0) {
+		pr_perror("%s: Failed to poll %s", id, MOUNTINFO_PATH);
+		return -1;
+	}
+
+	if (hv->valid && !(pfd.revents & (POLLPRI | POLLERR)))
+		return 0;
+
+	host_view_release(hv);
+
+	if (load_host_mounts(id, &hv->mounts, &hv->nr_umounts) != 0)
+		return -1;
+
+	hv->valid = true;
+	return 0;
+}
+
+/* Append a copy of pattern to plan. Returns 0 on success, -1 otherwise */
+static int plan_add(const char *id, struct umount_plan *plan, const char *pattern)
+{
+	if (plan->nr == plan->capacity) {
+		unsigned capacity = plan->capacity ? plan->capacity * 2 : 16;
+		char **patterns;
+
+		patterns = realloc(plan->patterns, capacity * sizeof(*patterns));
+		if (!patterns) {
+			pr_perror("%s: Failed to realloc unmount plan", id);
+			return -1;
+		}
+		plan->patterns = patterns;
+		plan->capacity = capacity;
+	}
+
+	plan->patterns[plan->nr] = strdup(pattern);
+	if (!plan->patterns[plan->nr]) {
+		pr_perror("%s: strdup(%s) failed.", id, pattern);
+		return -1;
+	}
+	plan->nr++;
+	return 0;
+}
+
+/*
+ * Build pattern for mounts in container in buf of PATH_MAX bytes. rootfs
+ * and path are taken literally and glob, if any, is appended to them.
+ * Returns false if result does not fit.
+ */
+static bool container_pattern(char *buf, const char *rootfs, const char *path, const char *glob)
+{
+	size_t len;
+
+	buf[0] = '\0';
+	if (!glob_append_literal(buf, PATH_MAX, rootfs) || !glob_append_literal(buf, PATH_MAX, path))
+		return false;
+
+	if (!glob)
+		return true;
+
+	len = strlen(buf);
+	return snprintf(buf + len, PATH_MAX - len, "/%s", glob) < (int)(PATH_MAX - len);
+}
+
+/*
+ * Map host mounts to be unmounted into paths in the container and record
+ * them in plan. Nothing here needs container's mount namespace, so this
+ * can run well before the container process exists.
+ */
+static int build_plan(
+	const char *id,
+	const char *rootfs,
+	const struct config_mount_info *config_mounts,
+	unsigned config_mounts_len,
+	const struct container_overrides *ov,
+	const struct host_mount_info *mounts_on_host,
+	int nr_umounts,
+	struct umount_plan *plan)
+{
+	_cleanup_host_mounts_ struct host_mount_info *overridden = NULL;
+	char pattern[PATH_MAX];
+	_cleanup_cptr_array_ char **mapped_paths = NULL;
+	int i, nr_mapped;
+
+	if (ov->add || ov->only) {
+		if (apply_overrides(id, ov, mounts_on_host, nr_umounts, &overridden, &nr_umounts) != 0)
+			return EXIT_FAILURE;
+		mounts_on_host = overridden;
+	}
+
+	if (!nr_umounts)
+		return 0;
+
+	/* Allocate one extra element and keep it zero for cleanup function */
+	mapped_paths = malloc((MAX_MAPS + 1) * sizeof(char *));
+	if (!mapped_paths) {
+		pr_perror("%s: Failed to malloc memory for mapped_paths array", id);
+		return EXIT_FAILURE;
+	}
+	memset((void *)mapped_paths, 0, (MAX_MAPS + 1) * sizeof(char *));
+
+	for (i = 0; i < nr_umounts; i++) {
+		nr_mapped = map_mount_host_to_container(id, config_mounts, config_mounts_len, mounts_on_host[i].path, mapped_paths, MAX_MAPS);
+		if (nr_mapped < 0) {
+			pr_perror("%s: Error while trying to map mount [%s] from host to conatiner. Skipping.", id, mounts_on_host[i].path);
+			continue;
+		}
+
+		if (!nr_mapped) {
+			pr_pinfo("%s: Could not find mapping for mount [%s] from host to conatiner. Skipping.", id, mounts_on_host[i].path);
+			continue;
+		}
+
+		for (int j = 0; j < nr_mapped; j++) {
+			if (!container_pattern(pattern, rootfs, mapped_paths[j], mounts_on_host[i].glob)) {
+				pr_pwarning("%s: Pattern for [%s] in container is too long. Skipping.", id, mapped_paths[j]);
+				continue;
+			}
+			if (plan_add(id, plan, pattern) < 0) {
+				free_char_ptr_array_entries(mapped_paths, nr_mapped);
+				return EXIT_FAILURE;
+			}
+		}
+		free_char_ptr_array_entries(mapped_paths, nr_mapped);
+	}
+	return 0;
+}
+
+/*
+ * setns() into a mount namespace fails if fs_struct is shared with another
+ * thread. With io_uring this is the case after it has been used, as its
+ * worker threads share it and linger for a while, so get a private copy
+ * first.
+ */
+static int join_mnt_ns(int fd)
+{
+	int ret = 0;
+
+	PROBE1(setns__start, fd);
+#ifdef USE_IO_URING
+	ret = unshare(CLONE_FS);
+#endif
+	if (!ret)
+		ret = setns(fd, CLONE_NEWNS);
+	PROBE2(setns__done, fd, ret ? errno : 0);
+	return ret;
+}
+
+/*
+ * Join mount namespace of pid and carry out the plan. Patterns are matched
+ * against the mount table of the namespace, so a plan computed earlier is
+ * safe to use even if some of its paths are no longer mount points. While
+ * pid still has the root of the hook (at prestart container has not
+ * switched root yet), the table is read from host through
+ * /proc/<pid>/mountinfo, and if nothing in it matches (e.g. hook already ran
+ * for this namespace) the namespace is not joined at all.
+ */
+static int execute_plan(const char *id, int pid, const struct umount_plan *plan)
+{
+	_cleanup_close_  int fd = -1;
+	_cleanup_mount_table_ struct mount_table mnt_table = { 0 };
+	_cleanup_glob_set_ struct glob_set patterns = { 0 };
+	_cleanup_free_ bool *matched = NULL;
+	char process_mnt_ns_fd[PATH_MAX];
+	char process_mountinfo[PATH_MAX];
+	char process_root[PATH_MAX];
+	struct stat root_st, st;
+	bool same_root = false;
+	unsigned i;
+
+	if (!plan->nr)
+		return 0;
+
+	for (i = 0; i < plan->nr; i++) {
+		if (glob_set_add(&patterns, plan->patterns[i]) < 0) {
+			pr_perror("%s: Failed to compile pattern [%s]", id, plan->patterns[i]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	snprintf(process_mnt_ns_fd, PATH_MAX, "/proc/%d/ns/mnt", pid);
+
+	fd = open(process_mnt_ns_fd, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("%s: Failed to open mnt namespace fd %s", id, process_mnt_ns_fd);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Paths in /proc/<pid>/mountinfo are relative to root of pid, the
+	 * ones umount2() gets after joining to root of the namespace. They
+	 * agree if pid has the same root as the hook.
+	 */
+	snprintf(process_root, PATH_MAX, "/proc/%d/root", pid);
+	if (stat(process_root, &root_st) == 0 && stat("/", &st) == 0)
+		same_root = st.st_dev == root_st.st_dev && st.st_ino == root_st.st_ino;
+
+	if (same_root) {
+		ssize_t nr_matched;
+
+		snprintf(process_mountinfo, PATH_MAX, "/proc/%d/mountinfo", pid);
+		if (parse_mountinfo(id, process_mountinfo, &mnt_table) < 0) {
+			pr_perror("%s: Failed to parse mountinfo table", id);
+			return EXIT_FAILURE;
+		}
+
+		nr_matched = match_mounts(id, &patterns, &mnt_table, &matched);
+		if (nr_matched < 0)
+			return EXIT_FAILURE;
+		if (!nr_matched) {
+			pr_pinfo("%s: Nothing to unmount", id);
+			return 0;
+		}
+	}
+
+	/* Join the mount namespace of the target process */
+	if (join_mnt_ns(fd) == -1) {
+		pr_perror("%s: Failed to setns to %s", id, process_mnt_ns_fd);
+		return EXIT_FAILURE;
+	}
+
+	/* Switch to the root directory */
+	if (chdir("/") == -1) {
+		pr_perror("%s: Failed to chdir", id);
+		return EXIT_FAILURE;
+	}
+
+	/* Root of the namespace may still differ, e.g. pid chrooted into "/" */
+	if (same_root && (stat("/", &st) < 0 || st.st_dev != root_st.st_dev || st.st_ino != root_st.st_ino)) {
+		free_mount_table(&mnt_table);
+		freep(&matched);
+		matched = NULL;
+		same_root = false;
+	}
+
+	if (!same_root) {
+		if (parse_mountinfo(id, MOUNTINFO_PATH, &mnt_table) < 0) {
+			pr_perror("%s: Failed to parse mountinfo table", id);
+			return EXIT_FAILURE;
+		}
+		if (match_mounts(id, &patterns, &mnt_table, &matched) < 0)
+			return EXIT_FAILURE;
+	}
+
+	unmount_matching(id, &mnt_table, matched);
+	return 0;
+}
+
+static int prestart(
+	const char *id,
+	const char *rootfs,
+	int pid,
+	const struct config_mount_info *config_mounts,
+	unsigned config_mounts_len,
+	const struct container_overrides *ov,
+	const struct host_mount_info *mounts_on_host,
+	int nr_umounts)
+{
+	pr_pinfo("prestart container_id:%s rootfs:%s", id, rootfs);
+	_cleanup_plan_ struct umount_plan plan = { 0 };
+
+	if (build_plan(id, rootfs, config_mounts, config_mounts_len, ov, mounts_on_host, nr_umounts, &plan) != 0)
+		return EXIT_FAILURE;
+
+	return execute_plan(id, pid, &plan);
+}
+
+/*
+ * Describe identity and version of a file in buf, so that a plan can tell
+ * whether files it was computed from have changed since.
+ */
+static void file_sig(const char *path, char *buf, size_t len)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		snprintf(buf, len, "-");
+		return;
+	}
+	snprintf(buf, len, "%ju:%ju:%jd:%jd.%09ld", (uintmax_t)st.st_dev,
+		 (uintmax_t)st.st_ino, (intmax_t)st.st_size,
+		 (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+}
+
+/*
+ * Plan file format. First line is version, followed by signatures of
+ * config.json and oci-umount.conf it was computed from. Then for every host
+ * path canonicalized while computing it, "canon <path>\t<canonical path>"
+ * or "canon <path>\t-" if it could not be canonicalized. Every other line
+ * is one pattern.
+ */
+static int write_plan(const char *id, const char *bundle, const char *config_sig, const char *conf_sig, const struct canon_log *log, const struct umount_plan *plan)
+{
+	char plan_file[PATH_MAX], tmp_file[PATH_MAX];
+	_cleanup_fclose_ FILE *fp = NULL;
+	unsigned i;
+
+	if (log->failed) {
+		pr_pwarning("%s: Failed to record host paths. Not writing plan.", id);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < plan->nr; i++) {
+		if (strchr(plan->patterns[i], '\n')) {
+			pr_pwarning("%s: Can't record path with newline in plan. Not writing plan.", id);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < log->nr; i++) {
+		if (strpbrk(log->entries[i].raw, "\t\n") || (log->entries[i].real && strpbrk(log->entries[i].real, "\t\n"))) {
+			pr_pwarning("%s: Can't record path with tab or newline in plan. Not writing plan.", id);
+			return EXIT_FAILURE;
+		}
+	}
+
+	snprintf(plan_file, PATH_MAX, "%s/%s", bundle, PLAN_FILE);
+	snprintf(tmp_file, PATH_MAX, "%s/.%s.tmp", bundle, PLAN_FILE);
+
+	fp = fopen(tmp_file, "w");
+	if (!fp) {
+		pr_perror("%s: Failed to open %s", id, tmp_file);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(fp, "oci-umount-plan %d\n", PLAN_VERSION);
+	fprintf(fp, "config %s\n", config_sig);
+	fprintf(fp, "conf %s\n", conf_sig);
+	for (i = 0; i < log->nr; i++)
+		fprintf(fp, "canon %s\t%s\n", log->entries[i].raw, log->entries[i].real ? log->entries[i].real : "-");
+	for (i = 0; i < plan->nr; i++)
+		fprintf(fp, "%s\n", plan->patterns[i]);
+
+	if (fflush(fp) == EOF || ferror(fp)) {
+		pr_perror("%s: Failed to write %s", id, tmp_file);
+		unlink(tmp_file);
+		return EXIT_FAILURE;
+	}
+
+	/* Replace old plan atomically, so prestart never sees a partial one */
+	if (rename(tmp_file, plan_file) < 0) {
+		pr_perror("%s: Failed to rename %s to %s", id, tmp_file, plan_file);
+		unlink(tmp_file);
+		return EXIT_FAILURE;
+	}
+	pr_pinfo("%s: Wrote plan with %u entries to %s", id, plan->nr, plan_file);
+	return 0;
+}
+
+/*
+ * Returns true if raw still canonicalizes to real, or still can't be
+ * canonicalized if real is "-".
+ */
+static bool canon_still_valid(const char *raw, const char *real)
+{
+	_cleanup_free_ char *now = realpath(raw, NULL);
+
+	if (!now)
+		return !strcmp(real, "-");
+	return !strcmp(now, real);
+}
+
+/*
+ * Load plan for bundle. Returns 0 if a valid plan was loaded, 1 if there is
+ * no plan or it is stale (config.json or oci-umount.conf changed since it
+ * was computed, or a host path canonicalizes differently now) and <0 on
+ * error.
+ */
+static int load_plan(const char *id, const char *bundle, struct umount_plan *plan)
+{
+	char plan_file[PATH_MAX], config_file[PATH_MAX], sig[BUFLEN];
+	char expected[BUFLEN + sizeof("oci-umount-plan ")];
+	char *real;
+	_cleanup_fclose_ FILE *fp = NULL;
+	_cleanup_free_ char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	unsigned lineno = 0;
+
+	snprintf(plan_file, PATH_MAX, "%s/%s", bundle, PLAN_FILE);
+	snprintf(config_file, PATH_MAX, "%s/config.json", bundle);
+
+	fp = fopen(plan_file, "r");
+	if (!fp) {
+		if (errno == ENOENT)
+			return 1;
+		pr_perror("%s: Failed to open %s", id, plan_file);
+		return -1;
+	}
+
+	while ((read = getline(&line, &len, fp)) != -1) {
+		if (read && line[read - 1] == '\n')
+			line[--read] = '\0';
+
+		switch (lineno++) {
+		case 0:
+			snprintf(expected, sizeof(expected), "oci-umount-plan %d", PLAN_VERSION);
+			break;
+		case 1:
+			file_sig(config_file, sig, BUFLEN);
+			snprintf(expected, sizeof(expected), "config %s", sig);
+			break;
+		case 2:
+			file_sig(MOUNTCONF, sig, BUFLEN);
+			snprintf(expected, sizeof(expected), "conf %s", sig);
+			break;
+		default:
+			if (!strncmp(line, "canon ", 6) && (real = strchr(line, '\t'))) {
+				*real++ = '\0';
+				if (!canon_still_valid(line + 6, real)) {
+					pr_pinfo("%s: [%s] on host changed since plan %s was computed. Recomputing.", id, line + 6, plan_file);
+					free_plan(plan);
+					return 1;
+				}
+				continue;
+			}
+			if (line[0] != '/') {
+				pr_pwarning("%s: Malformed line %u in %s", id, lineno, plan_file);
+				free_plan(plan);
+				return 1;
+			}
+			if (plan_add(id, plan, line) < 0) {
+				free_plan(plan);
+				return -1;
+			}
+			continue;
+		}
+
+		if (strcmp(line, expected)) {
+			pr_pinfo("%s: Plan %s is stale. Recomputing.", id, plan_file);
+			return 1;
+		}
+	}
+
+	if (lineno < 3) {
+		pr_pwarning("%s: Plan %s is truncated. Recomputing.", id, plan_file);
+		free_plan(plan);
+		return 1;
+	}
+	return 0;
+}
+
+
+/*
+ * Read the entire content of stream pointed to by 'from' into a buffer in memory.
+ * Return a pointer to the resulting NULL-terminated string and, if len is
+ * not NULL, its length in *len.
+ */
+char *getJSONstring(FILE *from, size_t chunksize, char *msg, size_t *len)
+{
+	struct stat stat_buf;
+	char *err = NULL, *JSONstring = NULL;
+	size_t nbytes, bufsize;
+
+	if (fstat(fileno(from), &stat_buf) == -1) {
+		err = "fstat failed";
+		goto fail;
 	}
 
 	if (S_ISREG(stat_buf.st_mode)) {
@@ -696,6 +1516,8 @@ char *getJSONstring(FILE *from, size_t chunksize, char *msg)
 
 	/* make sure the string is NULL-terminated */
 	JSONstring[bufsize] = 0;
+	if (len)
+		*len = bufsize;
 	return JSONstring;
 fail:
 	free(JSONstring);
@@ -703,27 +1525,73 @@ fail:
 	return NULL;
 }
 
-static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct config_mount_info **mounts, size_t *mounts_len)
+/* Returns bundle path from state, NULL if there is none */
+static const char *get_bundle_path(yajl_val node)
+{
+	const char *bundle_path[] = { "bundle", (const char *)0 };
+	yajl_val v_bundle_path = yajl_tree_get(node, bundle_path, yajl_t_string);
+	if (!v_bundle_path) {
+		const char *bundle_path[] = { "bundlePath", (const char *)0 };
+		v_bundle_path = yajl_tree_get(node, bundle_path, yajl_t_string);
+	}
+	return v_bundle_path ? YAJL_GET_STRING(v_bundle_path) : NULL;
+}
+
+/* Set *value to a copy of string annotation key, NULL if it is not there */
+static int get_annotation(const char *id, yajl_val config_node, const char *key, char **value)
+{
+	const char *annotation_path[] = { "annotations", key, (const char *)0 };
+	yajl_val v_annotation = yajl_tree_get(config_node, annotation_path, yajl_t_string);
+
+	*value = NULL;
+	if (!v_annotation)
+		return 0;
+
+	*value = strdup(YAJL_GET_STRING(v_annotation));
+	if (!*value) {
+		pr_perror("%s: strdup(%s) failed.", id, YAJL_GET_STRING(v_annotation));
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+
+/*
+ * Parse config.json of the bundle. If config is not NULL, it is content of
+ * config.json read earlier, otherwise the file is read here. If container
+ * opted out of the hook (ANNOTATION_SKIP), ov->skip is set and nothing else
+ * is extracted.
+ */
+static int parseBundle(const char *id, yajl_val *node_ptr, const struct io_file *config, char **rootfs, struct config_mount_info **mounts, size_t *mounts_len, struct container_overrides *ov)
 {
 	yajl_val node = *node_ptr;
 	char config_file_name[PATH_MAX];
 	char errbuf[BUFLEN];
-	char *configData;
+	_cleanup_free_ char *configData = NULL;
 	_cleanup_(yajl_tree_freep) yajl_val config_node = NULL;
 	_cleanup_config_mounts_ struct config_mount_info *config_mounts = NULL;
 	unsigned config_mounts_len = 0;
+	size_t config_len;
 	_cleanup_fclose_ FILE *fp = NULL;
 
 	/* 'bundle' must be specified for the OCI hooks, and from there we read the configuration file */
-	const char *bundle_path[] = { "bundle", (const char *)0 };
-	yajl_val v_bundle_path = yajl_tree_get(node, bundle_path, yajl_t_string);
-	if (!v_bundle_path) {
-		const char *bundle_path[] = { "bundlePath", (const char *)0 };
-		v_bundle_path = yajl_tree_get(node, bundle_path, yajl_t_string);
-	}
+	const char *bundle = get_bundle_path(node);
 
-	if (v_bundle_path) {
-		snprintf(config_file_name, PATH_MAX, "%s/config.json", YAJL_GET_STRING(v_bundle_path));
+	if (bundle && config) {
+		snprintf(config_file_name, PATH_MAX, "%s/config.json", bundle);
+		if (!config->data) {
+			errno = config->err;
+			pr_perror("%s: Failed to read config file: %s", id, config_file_name);
+			return EXIT_FAILURE;
+		}
+		configData = strdup(config->data);
+		if (!configData) {
+			pr_perror("%s: Failed to copy config data", id);
+			return EXIT_FAILURE;
+		}
+		config_len = config->len;
+		goto parse;
+	} else if (bundle) {
+		snprintf(config_file_name, PATH_MAX, "%s/config.json", bundle);
 		fp = fopen(config_file_name, "r");
 	} else {
 		char msg[] = "bundle not found in state";
@@ -737,10 +1605,11 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 
 	/* Read the entire config file */
 	snprintf(errbuf, BUFLEN, "failed to read config data from %s", config_file_name);
-	configData = getJSONstring(fp, (size_t)CHUNKSIZE, errbuf);
+	configData = getJSONstring(fp, (size_t)CHUNKSIZE, errbuf, &config_len);
 	if (configData == NULL)
 		return EXIT_FAILURE;
 
+parse:
 	/* Parse the config file */
 	memset(errbuf, 0, BUFLEN);
 	config_node = yajl_tree_parse((const char *)configData, errbuf, sizeof(errbuf));
@@ -753,6 +1622,21 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 		return EXIT_FAILURE;
 	}
 
+	/* Check for opt-out before doing anything else */
+	const char *skip_path[] = { "annotations", ANNOTATION_SKIP, (const char *)0 };
+	yajl_val v_skip = yajl_tree_get(config_node, skip_path, yajl_t_string);
+	if (v_skip && !strcasecmp(YAJL_GET_STRING(v_skip), "true")) {
+		pr_pinfo("%s: %s set. Skipping.", id, ANNOTATION_SKIP);
+		ov->skip = true;
+		return 0;
+	}
+
+	if (get_annotation(id, config_node, ANNOTATION_ADD, &ov->add) != 0)
+		return EXIT_FAILURE;
+
+	if (get_annotation(id, config_node, ANNOTATION_ONLY, &ov->only) != 0)
+		return EXIT_FAILURE;
+
 	/* Extract root path from the bundle */
 	const char *root_path[] = { "root", "path", (const char *)0 };
 	yajl_val v_root = yajl_tree_get(config_node, root_path, yajl_t_string);
@@ -772,7 +1656,7 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 	} else {
 		char *new_rootfs;
 
-		asprintf(&new_rootfs, "%s/%s", YAJL_GET_STRING(v_bundle_path), lrootfs);
+		asprintf(&new_rootfs, "%s/%s", bundle, lrootfs);
 		if (!new_rootfs) {
 			pr_perror("%s: failed to alloc rootfs", id);
 			return EXIT_FAILURE;
@@ -784,23 +1668,25 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 	const char *mount_points_path[] = {"mounts", (const char *)0 };
 	yajl_val v_mounts = yajl_tree_get(config_node, mount_points_path, yajl_t_array);
 	if (!v_mounts) {
-		pr_perror("%s: mounts not found in %s", id, config_file_name);
-		return EXIT_FAILURE;
+		/* mounts is optional in OCI spec, nothing can have leaked then */
+		pr_pinfo("%s: No mounts in %s", id, config_file_name);
+		PROBE3(bundle__done, id, 0, config_len);
+		*mounts = NULL;
+		*mounts_len = 0;
+		return 0;
 	}
 
-	config_mounts_len = YAJL_GET_ARRAY(v_mounts)->len;
 	/* Allocate one extra element which will be set to 0 and be used as
 	 * end of array in free function */
-	config_mounts = malloc(sizeof(struct config_mount_info) * (config_mounts_len + 1));
+	config_mounts = calloc(YAJL_GET_ARRAY(v_mounts)->len + 1, sizeof(struct config_mount_info));
 	if (!config_mounts) {
 		pr_perror("%s: error malloc'ing", id);
 		return EXIT_FAILURE;
 	}
 
-	memset(config_mounts, 0, sizeof(struct config_mount_info) * (config_mounts_len + 1));
-
-	for (unsigned int i = 0; i < config_mounts_len; i++) {
+	for (unsigned int i = 0; i < YAJL_GET_ARRAY(v_mounts)->len; i++) {
 		yajl_val v_mounts_values = YAJL_GET_ARRAY(v_mounts)->values[i];
+		struct config_mount_info *m = &config_mounts[config_mounts_len];
 
 		const char *destination_path[] = {"destination", (const char *)0 };
 		const char *source_path[] = {"source", (const char *)0 };
@@ -810,25 +1696,30 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 			pr_perror("%s: cannot find mount destination in %s", id, config_file_name);
 			return EXIT_FAILURE;
 		}
-		config_mounts[i].destination = strdup(YAJL_GET_STRING(v_destination));
-		if (!config_mounts[i].destination) {
-
-			pr_perror("%s: strdup(%s) failed.", id, YAJL_GET_STRING(v_destination));
-			return EXIT_FAILURE;
-		}
 
+		/* source is optional in OCI spec. Nothing on host maps through such a mount. */
 		yajl_val v_source = yajl_tree_get(v_mounts_values, source_path, yajl_t_string);
 		if (!v_source) {
-			pr_perror("%s: Cannot find mount source in %s", id, config_file_name);
+			pr_pdebug("%s: Mount %s has no source. Skipping.", id, YAJL_GET_STRING(v_destination));
+			continue;
+		}
+
+		m->destination = strdup(YAJL_GET_STRING(v_destination));
+		if (!m->destination) {
+			pr_perror("%s: strdup(%s) failed.", id, YAJL_GET_STRING(v_destination));
 			return EXIT_FAILURE;
 		}
-		config_mounts[i].source = strdup(YAJL_GET_STRING(v_source));
-		if (!config_mounts[i].source) {
+
+		m->source = strdup(YAJL_GET_STRING(v_source));
+		if (!m->source) {
 			pr_perror("%s: strdup(%s) failed.", id, YAJL_GET_STRING(v_source));
 			return EXIT_FAILURE;
 		}
+		path_sig_init(&m->source_sig, m->source);
+		config_mounts_len++;
 	}
 
+	PROBE3(bundle__done, id, config_mounts_len, config_len);
 	*mounts = config_mounts;
 	*mounts_len = config_mounts_len;
 	/* set it NULL so that gcc cleanup function does not try to free this */
@@ -837,23 +1728,218 @@ static int parseBundle(const char *id, yajl_val *node_ptr, char **rootfs, struct
 	return 0;
 }
 
+/*
+ * Extract container id and pid from the parsed state. On success *id is set
+ * to a newly allocated short id which caller needs to free. pid can be NULL
+ * if caller does not need it, and then it does not have to be in state.
+ */
+static int parse_state(yajl_val node, char **id, int *pid)
+{
+	const char *id_path[] = { "id", (const char *) 0 };
+	yajl_val v_id = yajl_tree_get(node, id_path, yajl_t_string);
+	if (!v_id) {
+		pr_perror("id not found in state");
+		return EXIT_FAILURE;
+	}
+	const char *container_id = YAJL_GET_STRING(v_id);
+	*id = shortid(container_id);
+	if (!*id) {
+		pr_perror("%s: failed to create shortid", container_id);
+		return EXIT_FAILURE;
+	}
+
+	if (!pid)
+		return 0;
+
+	const char *pid_path[] = { "pid", (const char *) 0 };
+	yajl_val v_pid = yajl_tree_get(node, pid_path, yajl_t_number);
+	if (!v_pid) {
+		pr_perror("%s: pid not found in state", *id);
+		return EXIT_FAILURE;
+	}
+	*pid = YAJL_GET_INTEGER(v_pid);
+	return 0;
+}
+
+/*
+ * Batch mode. Read newline delimited container states from stdin and run
+ * prestart for each of them. oci-umount.conf is parsed and canonicalized
+ * only once. After each container we switch back to the mount namespace we
+ * were started in, so that the next one starts from the same host view.
+ * One result line is written to stdout per input line.
+ */
+/* Print result line of batch mode, id escaped as a JSON string */
+static void print_batch_result(unsigned lineno, const char *id, const char *status)
+{
+	printf("{\"line\":%u,\"id\":\"", lineno);
+	for (; *id; id++) {
+		unsigned char c = *id;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	printf("\",\"status\":\"%s\"}\n", status);
+	fflush(stdout);
+}
+
+static int batch(void)
+{
+	_cleanup_close_ int host_ns_fd = -1;
+	_cleanup_host_view_ struct host_view hv = { .fd = -1 };
+	_cleanup_free_ char *line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	unsigned lineno = 0;
+	int nr_failed = 0;
+
+	host_ns_fd = open("/proc/self/ns/mnt", O_RDONLY);
+	if (host_ns_fd < 0) {
+		pr_perror("batch: Failed to open /proc/self/ns/mnt");
+		return EXIT_FAILURE;
+	}
+
+	if (host_view_init("batch", &hv) < 0)
+		return EXIT_FAILURE;
+
+	while ((read = getline(&line, &len, stdin)) != -1) {
+		_cleanup_(yajl_tree_freep) yajl_val node = NULL;
+		_cleanup_config_mounts_ struct config_mount_info *config_mounts = NULL;
+		_cleanup_free_ char *rootfs = NULL;
+		_cleanup_free_ char *id = NULL;
+		_cleanup_overrides_ struct container_overrides ov = { 0 };
+		size_t config_mounts_len = 0;
+		char errbuf[BUFLEN];
+		const char *status = "failed";
+		int pid = 0;
+
+		lineno++;
+		if (iscomment(line))
+			continue;
+
+		memset(errbuf, 0, BUFLEN);
+		node = yajl_tree_parse((const char *)line, errbuf, sizeof(errbuf));
+		if (node == NULL) {
+			pr_perror("batch: line %u: parse_error: %s", lineno, strlen(errbuf) ? errbuf : "unknown error");
+			goto result;
+		}
+
+		if (parse_state(node, &id, &pid) != 0)
+			goto result;
+
+		if (!pid) {
+			pr_pdebug("%s: pid 0 ignored", id);
+			status = "ignored";
+			goto result;
+		}
+
+		if (parseBundle(id, &node, NULL, &rootfs, &config_mounts, &config_mounts_len, &ov) != 0)
+			goto result;
+
+		if (ov.skip) {
+			status = "skipped";
+			goto result;
+		}
+
+		if (host_view_refresh(id, &hv) < 0)
+			goto result;
+
+		if (prestart(id, rootfs, pid, config_mounts, config_mounts_len, &ov, hv.mounts, hv.nr_umounts) == 0)
+			status = "ok";
+
+		/* Get back to where we started for the next container */
+		if (join_mnt_ns(host_ns_fd) == -1 || chdir("/") == -1) {
+			pr_perror("%s: Failed to switch back to host mount namespace", id);
+			print_batch_result(lineno, id, "failed");
+			return EXIT_FAILURE;
+		}
+result:
+		if (strcmp(status, "failed") == 0)
+			nr_failed++;
+		print_batch_result(lineno, id ? id : "", status);
+	}
+
+	return nr_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Plan phase. Compute unmount plan of a container from its bundle and save
+ * it next to config.json, so that prestart only has to execute it. This
+ * can run at any point after the bundle is written, e.g. as createRuntime
+ * hook.
+ */
+static int plan(const char *id, yajl_val node)
+{
+	_cleanup_free_ char *rootfs = NULL;
+	_cleanup_config_mounts_ struct config_mount_info *config_mounts = NULL;
+	_cleanup_host_mounts_ struct host_mount_info *mounts_on_host = NULL;
+	_cleanup_overrides_ struct container_overrides ov = { 0 };
+	_cleanup_plan_ struct umount_plan plan = { 0 };
+	_cleanup_io_file_ struct io_file config = { 0 };
+	_cleanup_canon_log_ struct canon_log log = { 0 };
+	char config_file[PATH_MAX], config_sig[BUFLEN], conf_sig[BUFLEN];
+	const char *bundle = get_bundle_path(node);
+	size_t config_mounts_len = 0;
+	int nr_umounts = 0, ret = EXIT_FAILURE;
+
+	if (!bundle) {
+		pr_perror("%s: bundle not found in state", id);
+		return EXIT_FAILURE;
+	}
+
+	/* Take signatures first, so that changes made while we read the
+	 * files make the plan stale rather than silently wrong */
+	snprintf(config_file, PATH_MAX, "%s/config.json", bundle);
+	file_sig(config_file, config_sig, BUFLEN);
+	file_sig(MOUNTCONF, conf_sig, BUFLEN);
+	config.path = config_file;
+	io_read_file(&config);
+
+	if (parseBundle(id, &node, &config, &rootfs, &config_mounts, &config_mounts_len, &ov) != 0)
+		return EXIT_FAILURE;
+
+	/* Opted out containers get an empty plan */
+	canon_log = &log;
+	if (!ov.skip) {
+		if (load_host_mounts(id, &mounts_on_host, &nr_umounts) != 0)
+			goto out;
+
+		if (build_plan(id, rootfs, config_mounts, config_mounts_len, &ov, mounts_on_host, nr_umounts, &plan) != 0)
+			goto out;
+	}
+
+	ret = write_plan(id, bundle, config_sig, conf_sig, &log, &plan);
+out:
+	canon_log = NULL;
+	return ret;
+}
+
 int main(int argc, char *argv[])
 {
 	_cleanup_(yajl_tree_freep) yajl_val node = NULL;
-	_cleanup_(yajl_tree_freep) yajl_val config_node = NULL;
 	char errbuf[BUFLEN];
-	char *stateData;
-	_cleanup_fclose_ FILE *fp = NULL;
+	_cleanup_free_ char *stateData = NULL;
 	_cleanup_free_ char *id = NULL;
-	int ret;
 	_cleanup_config_mounts_ struct config_mount_info *config_mounts = NULL;
 	size_t config_mounts_len = 0;
+	int target_pid;
+
+	if (argc >= 2 && !strcmp("batch", argv[1]))
+		return batch();
+
+	bool plan_only = argc >= 2 && (!strcmp("plan", argv[1]) || !strcmp("createRuntime", argv[1]));
+	/* Plan phase is only an optimization, prestart computes what it
+	 * didn't. Never fail container creation because of it. */
+	int failure = plan_only ? EXIT_SUCCESS : EXIT_FAILURE;
 
 	/* Read the entire state from stdin */
 	snprintf(errbuf, BUFLEN, "failed to read state data from standard input");
-	stateData = getJSONstring(stdin, (size_t)CHUNKSIZE, errbuf);
+	stateData = getJSONstring(stdin, (size_t)CHUNKSIZE, errbuf, NULL);
 	if (stateData == NULL)
-		return EXIT_FAILURE;
+		return failure;
 
 	/* Parse the state */
 	memset(errbuf, 0, BUFLEN);
@@ -864,29 +1950,17 @@ int main(int argc, char *argv[])
 		} else {
 			pr_perror("parse_error: unknown error");
 		}
-		return EXIT_FAILURE;
+		return failure;
 	}
 
-	const char *id_path[] = { "id", (const char *) 0 };
-	yajl_val v_id = yajl_tree_get(node, id_path, yajl_t_string);
-	if (!v_id) {
-		pr_perror("id not found in state");
-		return EXIT_FAILURE;
-	}
-	const char *container_id = YAJL_GET_STRING(v_id);
-	id = shortid(container_id);
-	if (!id) {
-		pr_perror("%s: failed to create shortid", container_id);
-		return EXIT_FAILURE;
-	}
+	if (parse_state(node, &id, plan_only ? NULL : &target_pid) != 0)
+		return failure;
 
-	const char *pid_path[] = { "pid", (const char *) 0 };
-	yajl_val v_pid = yajl_tree_get(node, pid_path, yajl_t_number);
-	if (!v_pid) {
-		pr_perror("%s: pid not found in state", id);
-		return EXIT_FAILURE;
+	if (plan_only) {
+		if (plan(id, node) != 0)
+			pr_pwarning("%s: No plan written, prestart will compute it", id);
+		return EXIT_SUCCESS;
 	}
-	int target_pid = YAJL_GET_INTEGER(v_pid);
 
 	/* OCI hooks set target_pid to 0 on poststop, as the container process
 	   already exited.  If target_pid is bigger than 0 then it is a start
@@ -899,11 +1973,43 @@ int main(int argc, char *argv[])
 	if ((argc >= 2 && !strcmp("prestart", argv[1])) ||
 	    (argc == 1 && target_pid)) {
 		_cleanup_free_ char *rootfs=NULL;
-		ret = parseBundle(id, &node, &rootfs, &config_mounts, &config_mounts_len);
-		if (ret < 0)
+		_cleanup_host_mounts_ struct host_mount_info *mounts_on_host = NULL;
+		_cleanup_overrides_ struct container_overrides ov = { 0 };
+		_cleanup_plan_ struct umount_plan plan = { 0 };
+		_cleanup_io_file_ struct io_file config = { 0 };
+		char config_file[PATH_MAX];
+		const char *bundle = get_bundle_path(node);
+		int nr_umounts = 0;
+
+		/* Use plan computed at an earlier stage if it is still valid */
+		if (bundle && load_plan(id, bundle, &plan) == 0) {
+			pr_pinfo("prestart container_id:%s using precomputed plan", id);
+			if (execute_plan(id, target_pid, &plan) != 0)
+				return EXIT_FAILURE;
+			return EXIT_SUCCESS;
+		}
+
+		/*
+		 * Read config.json alone. oci-umount.conf is not read along
+		 * with it, as containers which opt out must not depend on it.
+		 */
+		if (bundle) {
+			snprintf(config_file, PATH_MAX, "%s/config.json", bundle);
+			config.path = config_file;
+			io_read_file(&config);
+		}
+
+		if (parseBundle(id, &node, bundle ? &config : NULL, &rootfs, &config_mounts, &config_mounts_len, &ov) != 0)
+			return EXIT_FAILURE;
+
+		/* Container opted out. Don't even look at config file */
+		if (ov.skip)
+			return EXIT_SUCCESS;
+
+		if (load_host_mounts(id, &mounts_on_host, &nr_umounts) != 0)
 			return EXIT_FAILURE;
 
-		if (prestart(id, rootfs, target_pid, config_mounts, config_mounts_len) != 0) {
+		if (prestart(id, rootfs, target_pid, config_mounts, config_mounts_len, &ov, mounts_on_host, nr_umounts) != 0) {
 			return EXIT_FAILURE;
 		}
 	} else {
@@ -0,0 +1,15 @@
+#include "pathcmp.h"
+
+/* 32 bit FNV-1a. Length is computed in the same pass. */
+void path_sig_init(struct path_sig *sig, const char *path)
+{
+	uint32_t hash = 2166136261u;
+	const unsigned char *p = (const unsigned char *)path;
+
+	while (*p) {
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+	sig->len = (uint32_t)(p - (const unsigned char *)path);
+	sig->hash = hash;
+}
@@ -0,0 +1,37 @@
+#ifndef PATHCMP_H
+#define PATHCMP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Length and hash of a path. Stored next to the path so that most
+ * comparisons of mount paths, which tend to share long prefixes like
+ * /var/lib/docker/overlay2/, are decided without looking at path bytes.
+ */
+struct path_sig {
+	uint32_t len;
+	uint32_t hash;
+};
+
+void path_sig_init(struct path_sig *sig, const char *path);
+
+/*
+ * Compare n bytes of a and b for equality. glibc picks an SSE2, AVX2 or
+ * EVEX memcmp() for the CPU at runtime, which beats open coded SIMD here
+ * (see bench/pathcmp-bench.c).
+ */
+static inline bool path_bytes_equal(const char *a, const char *b, size_t n)
+{
+	return !memcmp(a, b, n);
+}
+
+static inline bool path_equal(const char *a, const struct path_sig *asig, const char *b, const struct path_sig *bsig)
+{
+	return asig->len == bsig->len && asig->hash == bsig->hash &&
+		path_bytes_equal(a, b, asig->len);
+}
+
+#endif /* PATHCMP_H */
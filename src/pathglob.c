@@ -0,0 +1,333 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fnmatch.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pathglob.h"
+
+#define GLOB_META "*?["
+
+static bool has_meta(const char *comp, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (comp[i] == '\\')
+			i++;
+		else if (strchr(GLOB_META, comp[i]))
+			return true;
+	}
+	return false;
+}
+
+static int push_comp(struct glob_set *set, enum glob_comp_type type, const char *str, size_t len)
+{
+	struct glob_comp *comp;
+
+	if (set->nr_states == set->capacity) {
+		unsigned capacity = set->capacity ? set->capacity * 2 : 32;
+
+		comp = realloc(set->comps, capacity * sizeof(*comp));
+		if (!comp)
+			return -1;
+		set->comps = comp;
+		set->capacity = capacity;
+	}
+
+	comp = &set->comps[set->nr_states];
+	comp->type = type;
+	comp->str = NULL;
+	comp->len = 0;
+	if (str) {
+		comp->str = strndup(str, len);
+		if (!comp->str)
+			return -1;
+		comp->len = len;
+	}
+	set->nr_states++;
+	return 0;
+}
+
+/* Remove backslash escapes from component in place, returns new length */
+static size_t unescape(char *comp)
+{
+	char *src, *dst;
+
+	for (src = dst = comp; *src; src++) {
+		if (*src == '\\' && src[1])
+			src++;
+		*dst++ = *src;
+	}
+	*dst = '\0';
+	return dst - comp;
+}
+
+int glob_set_add(struct glob_set *set, const char *pattern)
+{
+	unsigned first = set->nr_states;
+	const char *comp = pattern, *end;
+	size_t len;
+	int ret = 0;
+
+	if (pattern[0] != '/') {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (; !ret; comp = end) {
+		while (*comp == '/')
+			comp++;
+		if (!*comp)
+			break;
+		end = strchrnul(comp, '/');
+		len = end - comp;
+
+		if (len == 2 && !strncmp(comp, "**", 2)) {
+			/* A trailing "**" must match something */
+			if (!end[strspn(end, "/")])
+				ret = push_comp(set, GLOB_COMP_ONE, NULL, 0);
+			if (!ret)
+				ret = push_comp(set, GLOB_COMP_ANY, NULL, 0);
+		} else if (len == 1 && comp[0] == '*') {
+			ret = push_comp(set, GLOB_COMP_ONE, NULL, 0);
+		} else if (has_meta(comp, len)) {
+			ret = push_comp(set, GLOB_COMP_WILD, comp, len);
+		} else {
+			ret = push_comp(set, GLOB_COMP_LITERAL, comp, len);
+			if (!ret) {
+				struct glob_comp *c = &set->comps[set->nr_states - 1];
+				c->len = unescape(c->str);
+			}
+		}
+	}
+
+	if (!ret)
+		ret = push_comp(set, GLOB_COMP_END, NULL, 0);
+
+	if (ret) {
+		/* Drop partially compiled pattern */
+		while (set->nr_states > first)
+			free(set->comps[--set->nr_states].str);
+		return -1;
+	}
+	set->nr_patterns++;
+	return 0;
+}
+
+void glob_set_free(struct glob_set *set)
+{
+	for (unsigned i = 0; i < set->nr_states; i++)
+		free(set->comps[i].str);
+	free(set->comps);
+	memset(set, 0, sizeof(*set));
+}
+
+bool glob_append_literal(char *buf, size_t size, const char *str)
+{
+	size_t len = strlen(buf);
+
+	for (; *str; str++) {
+		if (*str == '\\' || strchr(GLOB_META, *str)) {
+			if (len + 1 >= size)
+				return false;
+			buf[len++] = '\\';
+		}
+		if (len + 1 >= size)
+			return false;
+		buf[len++] = *str;
+	}
+	buf[len] = '\0';
+	return true;
+}
+
+/*
+ * State sets are bitmaps of nr_words words. Adding a state adds states
+ * reachable from it without consuming a component as well.
+ */
+static inline void add_state(const struct glob_set *set, uint64_t *states, unsigned s)
+{
+	for (;;) {
+		states[s / 64] |= 1ull << (s % 64);
+		if (set->comps[s].type != GLOB_COMP_ANY)
+			break;
+		s++;
+	}
+}
+
+/* Compute states after consuming component comp of length len from cur */
+static bool step(const struct glob_set *set, const uint64_t *cur, uint64_t *next, size_t nr_words, const char *comp, size_t len)
+{
+	char name[PATH_MAX];
+	bool have_name = false, any = false;
+
+	memset(next, 0, nr_words * sizeof(*next));
+	for (size_t w = 0; w < nr_words; w++) {
+		uint64_t bits = cur[w];
+
+		while (bits) {
+			unsigned s = w * 64 + __builtin_ctzll(bits);
+			const struct glob_comp *c = &set->comps[s];
+
+			bits &= bits - 1;
+			switch (c->type) {
+			case GLOB_COMP_END:
+				continue;
+			case GLOB_COMP_LITERAL:
+				if (c->len != len || memcmp(c->str, comp, len))
+					continue;
+				break;
+			case GLOB_COMP_WILD:
+				if (!have_name) {
+					if (len >= sizeof(name))
+						continue;
+					memcpy(name, comp, len);
+					name[len] = '\0';
+					have_name = true;
+				}
+				if (fnmatch(c->str, name, 0))
+					continue;
+				break;
+			case GLOB_COMP_ONE:
+				break;
+			case GLOB_COMP_ANY:
+				/* Consume and stay */
+				add_state(set, next, s);
+				any = true;
+				continue;
+			}
+			add_state(set, next, s + 1);
+			any = true;
+		}
+	}
+	return any;
+}
+
+/* Number of leading components a and b have in common */
+static size_t common_depth(const char *a, const char *b)
+{
+	size_t i, depth = 0;
+
+	for (i = 0; a[i] && a[i] == b[i]; i++) {
+		if (a[i] == '/' && i && a[i - 1] != '/')
+			depth++;
+	}
+	if (i && a[i - 1] != '/' && (!a[i] || a[i] == '/') && (!b[i] || b[i] == '/'))
+		depth++;
+	return depth;
+}
+
+struct sorted_path {
+	const char *path;
+	size_t idx;
+};
+
+static int cmp_sorted_path(const void *a, const void *b)
+{
+	return strcmp(((const struct sorted_path *)a)->path, ((const struct sorted_path *)b)->path);
+}
+
+int glob_set_match(const struct glob_set *set, const char *const *paths, size_t nr, bool *matched)
+{
+	size_t nr_words = (set->nr_states + 63) / 64;
+	size_t depth, max_depth = 0, i, w;
+	struct sorted_path *sorted = NULL;
+	uint64_t *stack = NULL, *accept = NULL;
+	const char *prev = "";
+	unsigned s;
+	int ret = -1;
+
+	memset(matched, 0, nr * sizeof(*matched));
+	if (!nr || !set->nr_patterns)
+		return 0;
+
+	/*
+	 * Visit paths in sorted order, so that paths sharing leading
+	 * components come one after another. stack has the state set after
+	 * every component of the previous path. States for the part a path
+	 * shares with the previous one are taken from there.
+	 */
+	sorted = malloc(nr * sizeof(*sorted));
+	if (!sorted)
+		goto out;
+	for (i = 0; i < nr; i++) {
+		sorted[i].path = paths[i];
+		sorted[i].idx = i;
+	}
+	qsort(sorted, nr, sizeof(*sorted), cmp_sorted_path);
+
+	accept = calloc(nr_words, sizeof(*accept));
+	if (!accept)
+		goto out;
+	for (s = 0; s < set->nr_states; s++) {
+		if (set->comps[s].type == GLOB_COMP_END)
+			accept[s / 64] |= 1ull << (s % 64);
+	}
+
+	max_depth = 16;
+	stack = calloc((max_depth + 1) * nr_words, sizeof(*stack));
+	if (!stack)
+		goto out;
+	for (s = 0; s < set->nr_states; s++) {
+		add_state(set, stack, s);
+		/* Skip to start of next pattern */
+		while (set->comps[s].type != GLOB_COMP_END)
+			s++;
+	}
+
+	for (i = 0; i < nr; i++) {
+		const char *path = sorted[i].path, *comp, *end;
+		bool alive = true;
+		size_t skip;
+
+		depth = common_depth(prev, path);
+		prev = path;
+
+		/* Walk past components already done for previous path */
+		comp = path;
+		for (skip = 0; ; skip++) {
+			while (*comp == '/')
+				comp++;
+			if (skip == depth || !*comp)
+				break;
+			comp = strchrnul(comp, '/');
+		}
+
+		for (; *comp; comp = end) {
+			uint64_t *cur = stack + depth * nr_words;
+
+			end = strchrnul(comp, '/');
+			if (depth == max_depth) {
+				uint64_t *p = realloc(stack, (max_depth * 2 + 1) * nr_words * sizeof(*stack));
+
+				if (!p)
+					goto out;
+				stack = p;
+				max_depth *= 2;
+				cur = stack + depth * nr_words;
+			}
+
+			if (alive)
+				alive = step(set, cur, cur + nr_words, nr_words, comp, end - comp);
+			else
+				memset(cur + nr_words, 0, nr_words * sizeof(*stack));
+			depth++;
+
+			while (*end == '/')
+				end++;
+		}
+
+		for (w = 0; w < nr_words; w++) {
+			if (stack[depth * nr_words + w] & accept[w]) {
+				matched[sorted[i].idx] = true;
+				break;
+			}
+		}
+	}
+	ret = 0;
+out:
+	free(sorted);
+	free(accept);
+	free(stack);
+	return ret;
+}
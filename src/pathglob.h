@@ -0,0 +1,56 @@
+#ifndef PATHGLOB_H
+#define PATHGLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Set of absolute path patterns, matched one path component at a time. A
+ * "**" component matches any number of components, but at least one if it
+ * ends the pattern. Any other component with *, ? or [ in it is matched
+ * with fnmatch(), the rest must be equal (a backslash escapes the next
+ * character).
+ *
+ * Patterns are compiled into one automaton with a state for every position
+ * in every pattern, so a path is checked against all of them at once.
+ */
+enum glob_comp_type {
+	GLOB_COMP_END,		/* Pattern matched */
+	GLOB_COMP_LITERAL,	/* Component equal to str */
+	GLOB_COMP_WILD,		/* Component matching str with fnmatch() */
+	GLOB_COMP_ONE,		/* Any one component */
+	GLOB_COMP_ANY,		/* Zero or more components */
+};
+
+struct glob_comp {
+	enum glob_comp_type type;
+	size_t len;
+	char *str;
+};
+
+struct glob_set {
+	struct glob_comp *comps;	/* Indexed by state */
+	unsigned nr_states;
+	unsigned capacity;
+	unsigned nr_patterns;
+};
+
+/* Compile pattern into set. Returns -1 with errno set on failure. */
+int glob_set_add(struct glob_set *set, const char *pattern);
+
+void glob_set_free(struct glob_set *set);
+
+/*
+ * Set matched[i] to whether paths[i] matches one of the patterns in set.
+ * Paths are walked as a tree, so work for components shared by several
+ * paths is done only once. Returns -1 with errno set on failure.
+ */
+int glob_set_match(const struct glob_set *set, const char *const *paths, size_t nr, bool *matched);
+
+/*
+ * Append str to NUL terminated string in buf, escaped so that it only
+ * matches itself when used in a pattern. Returns false if it does not fit.
+ */
+bool glob_append_literal(char *buf, size_t size, const char *str);
+
+#endif /* PATHGLOB_H */
@@ -0,0 +1,28 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT static tracepoints, provider oci_umount. With sys/sdt.h each probe
+ * is a single nop plus a note in the ELF file, so it costs nothing unless
+ * a tracer (bpftrace, perf, systemtap) attaches to it. Arguments must be
+ * values which are at hand anyway, as they are computed either way.
+ * Without sys/sdt.h probes compile to nothing, arguments are only
+ * referenced to keep the compiler from warning about them.
+ *
+ * See contrib/bpftrace for scripts using them.
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE0(name)			DTRACE_PROBE(oci_umount, name)
+#define PROBE1(name, a)			DTRACE_PROBE1(oci_umount, name, a)
+#define PROBE2(name, a, b)		DTRACE_PROBE2(oci_umount, name, a, b)
+#define PROBE3(name, a, b, c)		DTRACE_PROBE3(oci_umount, name, a, b, c)
+#else
+#define PROBE0(name)			do { } while (0)
+#define PROBE1(name, a)			do { (void)(a); } while (0)
+#define PROBE2(name, a, b)		do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)		do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#endif /* PROBES_H */